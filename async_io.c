@@ -0,0 +1,240 @@
+/**
+    @file async_io.c
+    @brief Asynchronous positioned file reads and writes for batch rendering.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+#include "async_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+// Set up an io_uring with depth entries; returns 0 if the kernel refuses it
+// (too old, or blocked by seccomp) or its rings cannot be mapped, having
+// released anything it set up, so the caller can fall back
+static int uringInit(AsyncIO *io)
+{
+    struct io_uring_params params;
+    unsigned char *sq, *cq;
+
+    memset(&params, 0, sizeof(params));
+    io->ringFd = syscall(__NR_io_uring_setup, io->depth, &params);
+    if (io->ringFd < 0)
+        return 0;
+    // IORING_OP_READ/WRITE arrived in the same kernel as this feature
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(io->ringFd);
+        return 0;
+    }
+
+    io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (io->cqRingSize > io->sqRingSize)
+            io->sqRingSize = io->cqRingSize;
+        io->cqRingSize = io->sqRingSize;
+    }
+    io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd,
+                      IORING_OFF_SQ_RING);
+    if (io->sqRing == MAP_FAILED)
+    {
+        close(io->ringFd);
+        return 0;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        io->cqRing = io->sqRing;
+    else
+        io->cqRing = mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd,
+                          IORING_OFF_CQ_RING);
+    io->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd,
+                    IORING_OFF_SQES);
+    if (io->cqRing == MAP_FAILED || io->sqes == MAP_FAILED)
+    {
+        // give back whatever did map, and fall back like a refused setup
+        if (io->sqes != MAP_FAILED)
+            munmap(io->sqes, io->sqesSize);
+        if (io->cqRing != MAP_FAILED && io->cqRing != io->sqRing)
+            munmap(io->cqRing, io->cqRingSize);
+        munmap(io->sqRing, io->sqRingSize);
+        close(io->ringFd);
+        return 0;
+    }
+
+    sq = (unsigned char *)io->sqRing;
+    cq = (unsigned char *)io->cqRing;
+    io->sqHead = (unsigned *)(sq + params.sq_off.head);
+    io->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    io->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    io->sqArray = (unsigned *)(sq + params.sq_off.array);
+    io->cqHead = (unsigned *)(cq + params.cq_off.head);
+    io->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    io->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    io->cqes = cq + params.cq_off.cqes;
+    io->queued = 0;
+    return 1;
+}
+
+// Queue a read or write in the submission ring; it is handed to the kernel by the next wait
+static void uringQueue(AsyncIO *io, int opcode, int fd, const void *buf, size_t len, off_t offset, void *user)
+{
+    unsigned tail = *io->sqTail;
+    unsigned index = tail & *io->sqMask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)io->sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = (unsigned long)user;
+    io->sqArray[index] = index;
+    __atomic_store_n(io->sqTail, tail + 1, __ATOMIC_RELEASE);
+    io->queued++;
+}
+
+// Submit everything queued and wait for at least one completion
+static void uringWait(AsyncIO *io, AsyncCompletion *completion)
+{
+    unsigned head = *io->cqHead;
+    struct io_uring_cqe *cqe;
+
+    while (head == __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE))
+    {
+        int submitted = syscall(__NR_io_uring_enter, io->ringFd, io->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (submitted > 0)
+            io->queued -= submitted;
+    }
+    cqe = (struct io_uring_cqe *)io->cqes + (head & *io->cqMask);
+    completion->user = (void *)(unsigned long)cqe->user_data;
+    completion->result = cqe->res;
+    __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+}
+
+static void uringClose(AsyncIO *io)
+{
+    munmap(io->sqes, io->sqesSize);
+    if (io->cqRing != io->sqRing)
+        munmap(io->cqRing, io->cqRingSize);
+    munmap(io->sqRing, io->sqRingSize);
+    close(io->ringFd);
+}
+#endif
+
+// Create a queue for up to depth requests in flight. Asking for ASYNC_IO_URING
+// falls back to ASYNC_IO_SYNC if io_uring is not available
+void asyncInit(AsyncIO *io, int depth, int backend)
+{
+    io->depth = depth;
+    io->inFlight = 0;
+    io->backend = ASYNC_IO_SYNC;
+    io->done = NULL;
+#ifdef HAVE_IO_URING
+    if (backend == ASYNC_IO_URING && uringInit(io))
+        io->backend = ASYNC_IO_URING;
+#else
+    (void)backend;
+#endif
+    if (io->backend == ASYNC_IO_SYNC)
+    {
+        io->done = (AsyncCompletion *)malloc(sizeof(*io->done) * depth);
+        io->doneHead = 0;
+        io->doneCount = 0;
+    }
+}
+
+// Record a completed synchronous request
+static void syncComplete(AsyncIO *io, void *user, long result)
+{
+    AsyncCompletion *completion = &io->done[(io->doneHead + io->doneCount) % io->depth];
+    completion->user = user;
+    completion->result = result < 0 ? -errno : result;
+    io->doneCount++;
+}
+
+// Start reading len bytes at offset into buf. At most depth requests may be in flight
+void asyncRead(AsyncIO *io, int fd, void *buf, size_t len, off_t offset, void *user)
+{
+    io->inFlight++;
+#ifdef HAVE_IO_URING
+    if (io->backend == ASYNC_IO_URING)
+    {
+        uringQueue(io, IORING_OP_READ, fd, buf, len, offset, user);
+        return;
+    }
+#endif
+    syncComplete(io, user, pread(fd, buf, len, offset));
+}
+
+// Start writing len bytes from buf at offset. At most depth requests may be in flight
+void asyncWrite(AsyncIO *io, int fd, const void *buf, size_t len, off_t offset, void *user)
+{
+    io->inFlight++;
+#ifdef HAVE_IO_URING
+    if (io->backend == ASYNC_IO_URING)
+    {
+        uringQueue(io, IORING_OP_WRITE, fd, buf, len, offset, user);
+        return;
+    }
+#endif
+    syncComplete(io, user, pwrite(fd, buf, len, offset));
+}
+
+// Wait for the next request to finish. Returns 0 if nothing is in flight
+int asyncWait(AsyncIO *io, AsyncCompletion *completion)
+{
+    if (io->inFlight == 0)
+        return 0;
+    io->inFlight--;
+#ifdef HAVE_IO_URING
+    if (io->backend == ASYNC_IO_URING)
+    {
+        uringWait(io, completion);
+        return 1;
+    }
+#endif
+    *completion = io->done[io->doneHead];
+    io->doneHead = (io->doneHead + 1) % io->depth;
+    io->doneCount--;
+    return 1;
+}
+
+void asyncClose(AsyncIO *io)
+{
+#ifdef HAVE_IO_URING
+    if (io->backend == ASYNC_IO_URING)
+        uringClose(io);
+#endif
+    free(io->done);
+}
+
+const char *asyncBackendName(const AsyncIO *io)
+{
+    return io->backend == ASYNC_IO_URING ? "io_uring" : "pread/pwrite";
+}
@@ -0,0 +1,63 @@
+/**
+    @file async_io.h
+    @brief Asynchronous positioned file reads and writes for batch rendering.
+    Uses io_uring (through raw system calls) on Linux when the kernel allows it,
+    and otherwise falls back to synchronous pread/pwrite behind the same interface.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+
+#ifndef __ASYNC_IO_H__
+#define __ASYNC_IO_H__
+#include <stddef.h>
+#include <sys/types.h>
+
+#define ASYNC_IO_SYNC 0
+#define ASYNC_IO_URING 1
+
+/** @struct AsyncCompletion A finished request: the pointer it was submitted
+    with, and the bytes transferred or a negative errno */
+typedef struct AsyncCompletion
+{
+    void *user;
+    long result;
+} AsyncCompletion;
+
+/** @struct AsyncIO A queue of up to depth requests in flight */
+typedef struct AsyncIO
+{
+    int backend;
+    int depth;
+    int inFlight;
+
+    // io_uring
+    int ringFd;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    void *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    void *cqes;
+    int queued;
+
+    // synchronous fallback: requests complete immediately and wait here
+    AsyncCompletion *done;
+    int doneHead;
+    int doneCount;
+} AsyncIO;
+
+void asyncInit(AsyncIO *io, int depth, int backend);
+void asyncRead(AsyncIO *io, int fd, void *buf, size_t len, off_t offset, void *user);
+void asyncWrite(AsyncIO *io, int fd, const void *buf, size_t len, off_t offset, void *user);
+int asyncWait(AsyncIO *io, AsyncCompletion *completion);
+void asyncClose(AsyncIO *io);
+const char *asyncBackendName(const AsyncIO *io);
+
+#endif
@@ -14,39 +14,155 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
-// Create a delay line with a given maximum length
-// Delay will start out with a delay equal to the maximum
-DelayLine *create_delay()
+// time constant of the average DSP load, in seconds of processed audio
+#define LOAD_AVERAGE_TIME 1.0
+
+// DSP load meter. It lives as long as the reverb, and every field is atomic,
+// so a monitoring thread can read it at any time without locking. Only the
+// audio thread writes the statistics: enabled gates the metering, and reset
+// is a request the audio thread carries out before its next update
+typedef struct ReverbLoadMeter
 {
-    DelayLine *delay = (DelayLine *)malloc(sizeof(*delay));
+    atomic_bool enabled;
+    atomic_bool reset;
+    _Atomic float current;
+    _Atomic float average;
+    _Atomic float peak;
+    atomic_ulong overruns;
+    atomic_ulong calls;
+} ReverbLoadMeter;
+
+// Half-band filters for the multirate tank: 47 taps, of which only the centre
+// (0.5) and the odd taps either side of it are nonzero, so each output of a
+// decimator by 2, or pair of outputs of an interpolator by 2, costs 12
+// multiplies. Kaiser windowed, flat to 0.195 and 79dB down from 0.305 of the
+// higher rate
+#define HALFBAND_COEFFS 12
+#define HALFBAND_CENTRE (2 * HALFBAND_COEFFS - 1)
+// history ring length, a power of two longer than the filter
+#define HALFBAND_HISTORY 64
+
+static const float halfband_coeffs[HALFBAND_COEFFS] = {
+    3.161028551e-01f, -9.965566535e-02f, 5.342200352e-02f, -3.212372664e-02f,
+    1.973593894e-02f, -1.189122084e-02f, 6.840481745e-03f, -3.664522489e-03f,
+    1.771805849e-03f, -7.347076094e-04f, 2.337539512e-04f, -3.699619544e-05f};
+
+// Input history of one half-band filter. Each sample is stored twice, so the
+// most recent HALFBAND_HISTORY samples are always contiguous
+typedef struct HalfBand
+{
+    float history[2 * HALFBAND_HISTORY];
+    int pos;
+} HalfBand;
+
+// Resampling state of a decimated reverb: one half-band stage per factor of 2
+// down to the tank rate for each input (just the first without true stereo),
+// and back up for each output channel
+typedef struct ReverbMultirate
+{
+    HalfBand decimator[2][2];
+    HalfBand interpolator[REVERB_MAX_OUTPUTS][2];
+    // wet output of the last tank step, at the full rate
+    float wet[REVERB_MAX_OUTPUTS][4];
+    // full-rate frames since the last tank step
+    int phase;
+} ReverbMultirate;
+
+// Seconds of frozen tank output cached as a loop, and of the crossfades that
+// close the loop and hand back from it to the running tank
+#define FREEZE_LOOP_TIME 2.0
+#define FREEZE_FADE_TIME 0.1
+
+// A frozen tank is held to the level of its loop signals over its first
+// FREEZE_LOOP_TIME. Only a rise of more than FREEZE_HOLD_MARGIN in power is
+// pulled back, at FREEZE_HOLD_RATE in loop gain per unit of excess
+#define FREEZE_HOLD_MARGIN 1.12
+#define FREEZE_HOLD_RATE 0.05
+#define FREEZE_HOLD_MIN_GAIN 0.9
+
+// A frozen, unmodulated tank recorded as a loop of its tap set outputs at the
+// tank rate, to be played back instead of run. The first loop_frames are
+// recorded as the tank runs; over the next fade_frames the start of the loop
+// is crossfaded with the running output, which closes the loop without a
+// seam. The loop then plays from position. A release (release frames left)
+// crossfades back to the running tank, then drops the loop
+typedef struct ReverbFreeze
+{
+    int n_sets;
+    int loop_frames;
+    int fade_frames;
+    int recorded;
+    int position;
+    int release;
+    float loop[]; // loop_frames frames of n_sets
+} ReverbFreeze;
+
+static size_t freeze_bytes(const ReverbFreeze *freeze)
+{
+    return sizeof(*freeze) + sizeof(*freeze->loop) * freeze->loop_frames * freeze->n_sets;
+}
 
-    delay->max_n_samples = INIT_DELAY_MAX * 2;
-    delay->n_samples = INIT_DELAY_MAX * 2;
-    delay->read_offset = INIT_DELAY_MAX;
+static void reverb_frame(DattoroReverb *reverb, float l, float r, float *out, bool layout);
+static void update_freeze(DattoroReverb *reverb);
+static void reserve_quality_switch(DattoroReverb *reverb);
+static void switch_quality(DattoroReverb *reverb, int quality);
+
+// Set up a delay line around max_n_samples of silent samples
+static void init_delay(DelayLine *delay, float *samples, int max_n_samples)
+{
+    delay->max_n_samples = max_n_samples;
+    delay->fixed_capacity = 0;
+    // a line starts at the longest delay that fits, as set_delay would leave
+    // it, so one that is never sized is still a valid line
+    delay->read_offset = (max_n_samples - 2) / 2;
+    delay->n_samples = delay->read_offset * 2;
     delay->interpolation_mode = MODDELAY_INTERPOLATION_ALLPASS;
     delay->write_head = 0;
-    delay->n_samples = 0;
+    delay->used = 0;
     delay->modulation_extent = 0.0;
     delay->modulation_frequency = 0.0;
     delay->phase = 0.0;
     delay->read_fraction = 0.0;
     delay->excursion = 0.0;
-    delay->samples = (float *)calloc(sizeof(*delay->samples), delay->max_n_samples);
+    delay->samples = samples;
     delay->allpass_a = 0.0;
     delay->modulated = 0;
     delay->feedback = 0.0;
+}
+
+// Create a delay line with a given maximum length
+// Delay will start out with a delay equal to the maximum
+DelayLine *create_delay()
+{
+    DelayLine *delay = (DelayLine *)malloc(sizeof(*delay));
 
+    init_delay(delay, (float *)calloc(sizeof(*delay->samples), INIT_DELAY_MAX * 2), INIT_DELAY_MAX * 2);
     return delay;
 }
 
+// Move the read point to where the modulation is at its current phase
+static void update_excursion(DelayLine *delay)
+{
+    double offset = sin(delay->phase) * delay->modulation_extent;
+
+    delay->excursion = floor(offset);
+    delay->read_fraction = offset - floor(offset);
+}
+
 // set the frequency and extent of the modulation on this delay line
-// if modulation extent is 0, don't modulate
+// if modulation extent is 0, don't modulate; if the frequency is 0, hold
+// the read point where the modulation has got to
 void set_modulation_delay(DelayLine *delay, float modulation_extent, float modulation_frequency)
 {
+    delay->modulation_extent = modulation_extent;
+    delay->modulation_frequency = modulation_frequency;
 
     if (delay->modulation_extent >= delay->read_offset)
-        delay->modulation_extent = delay->read_offset - 1;
+        delay->modulation_extent = delay->read_offset > 0 ? delay->read_offset - 1 : 0;
 
     if (delay->modulation_extent == 0.0)
     {
@@ -54,10 +170,10 @@ void set_modulation_delay(DelayLine *delay, float modulation_extent, float modul
         delay->excursion = 0;
     }
     else
+    {
         delay->modulated = 1;
-
-    delay->modulation_extent = modulation_extent;
-    delay->modulation_frequency = modulation_frequency;
+        update_excursion(delay);
+    }
 }
 
 // Destroy a delay line object
@@ -70,7 +186,6 @@ void destroy_delay(DelayLine *delay)
 // Take a new sample into the delay line
 void delay_in(DelayLine *delay, float sample)
 {
-    double offset;
      // feedback, if enabled
   
     delay->samples[delay->write_head] = sample;
@@ -82,13 +197,12 @@ void delay_in(DelayLine *delay, float sample)
     
     delay->write_head++;
 
-    if (delay->modulated)
+    // a modulation frequency of 0 holds the read point where it is
+    if (delay->modulated && delay->modulation_frequency != 0.0)
     {
         // update phase
         delay->phase += (2 * M_PI * delay->modulation_frequency);
-        offset = sin(delay->phase) * delay->modulation_extent;
-        delay->excursion = floor(offset);
-        delay->read_fraction = offset - floor(offset);
+        update_excursion(delay);
     }
     if (delay->write_head >= delay->n_samples)
         delay->write_head = 0;
@@ -126,6 +240,11 @@ float delay_out(DelayLine *delay)
         bread -= delay->n_samples;
     if (aread >= delay->n_samples)
         aread -= delay->n_samples;
+    // a short delay line can modulate back past the write head
+    if (aread < 0)
+        aread += delay->n_samples;
+    if (bread < 0)
+        bread += delay->n_samples;
 
     an = delay->samples[aread];
     bn = delay->samples[bread];
@@ -148,27 +267,53 @@ float delay_out(DelayLine *delay)
     }
 }
 
+// Buffer capacity a delay line with the given capacity ends up with after set_delay(length)
+// Delay lines always need 2*delay_length samples, and never shrink
+static int delay_capacity(int capacity, float length)
+{
+    int delay_length = (int)length;
+    if (delay_length * 2 >= capacity - 1)
+        capacity = delay_length * 2 + 1;
+    return capacity;
+}
+
+// Expand a delay line, keeping its contents, if it has no room for a delay
+// of length. Lines that cannot grow are left as they are
+static void grow_delay(DelayLine *delay, float length)
+{
+    int capacity = delay_capacity(delay->max_n_samples, length);
+    if (delay->fixed_capacity || capacity == delay->max_n_samples)
+        return;
+
+    int i, old_length;
+    old_length = delay->max_n_samples;
+    delay->max_n_samples = capacity;
+    delay->samples = (float *)realloc(delay->samples, sizeof(*delay->samples) * delay->max_n_samples);
+    for (i = old_length; i < delay->max_n_samples; i++)
+        delay->samples[i] = 0.0;
+}
+
 // Set the delay line length
 void set_delay(DelayLine *delay, float length)
 {
     // expand the delay line if the new delay is longer than the current delay line
-    // always need 2*delay_length samples
     // read head is centered on write_head + delay_length
+    // a line that cannot grow is limited to the longest delay that fits
+    if (delay->fixed_capacity && delay_capacity(delay->max_n_samples, length) != delay->max_n_samples)
+        length = (delay->max_n_samples - 2) / 2;
     int delay_length = (int)length;
-    if (delay_length * 2 >= delay->max_n_samples-1)
-    {
-        int i, old_length;
-        old_length = delay->max_n_samples;
-        delay->max_n_samples = delay_length * 2 + 1;
-        delay->samples = (float *)realloc(delay->samples, sizeof(*delay->samples) * delay->max_n_samples);
-        for (i = old_length; i < delay->max_n_samples; i++)
-            delay->samples[i] = 0.0;
-    }
+    grow_delay(delay, length);
 
-    if (delay_length > 2)
-        delay->read_offset = delay_length;
+    // the read head always stays inside the line, even for a zero length
+    // line, which reads back the sample just written
+    delay->read_offset = delay_length;
 
     delay->n_samples = delay_length * 2;
+    // a shortened line wraps at once, so the write head is always inside it
+    if (delay->write_head >= delay->n_samples)
+        delay->write_head = 0;
+    if (delay->n_samples > delay->used)
+        delay->used = delay->n_samples;
     delay->read_fraction = length - delay_length;
 }
 
@@ -203,24 +348,410 @@ enum DELAY_NAMES
     DELAY_3163,
     DELAY_1800,
     DELAY_2656,
+    // input diffusers of the right channel in true stereo
+    DELAY_142_R,
+    DELAY_379_R,
+    DELAY_107_R,
+    DELAY_277_R,
     DELAY_MAX
 };
 
+_Static_assert(DELAY_MAX == REVERB_DELAY_LINES, "delay_lines must hold every network delay line");
+
+// delay lengths in samples at the original 29761Hz sample rate. The right
+// input diffusers match the left, so a centred source in true stereo sounds
+// exactly as it does through the mixed input
+static const int delay_times[DELAY_MAX] = {142, 379, 107, 277, 672, 908, 4453, 4217, 3720, 3163, 1800, 2656,
+                                           142, 379, 107, 277};
+
+// Input diffusers in the order they are run, with the diffusion of each,
+// for the left (or mixed) input then the right
+static const int input_diffusers[2][4] = {{DELAY_142, DELAY_107, DELAY_379, DELAY_277},
+                                          {DELAY_142_R, DELAY_107_R, DELAY_379_R, DELAY_277_R}};
+
+// Every delay line of a reverb into delays, which holds REVERB_ALL_DELAYS:
+// the predelays, left then right, then the network
+void reverb_delays(const DattoroReverb *reverb, DelayLine **delays)
+{
+    delays[0] = reverb->pre_delay;
+    delays[1] = reverb->pre_delay_r;
+    for (int i = 0; i < DELAY_MAX; i++)
+        delays[i + 2] = reverb->delay_lines[i];
+}
+
+// Point a reverb at delay lines in the order of reverb_delays
+void reverb_set_delays(DattoroReverb *reverb, DelayLine *const *delays)
+{
+    reverb->pre_delay = delays[0];
+    reverb->pre_delay_r = delays[1];
+    for (int i = 0; i < DELAY_MAX; i++)
+        reverb->delay_lines[i] = delays[i + 2];
+}
+
+// Stereo output taps: the delay line, the position in samples, and the sign,
+// for the left output then the right
+static const ReverbOutputTap stereo_taps[2][REVERB_OUTPUT_TAPS] = {
+    {{DELAY_4217, 266, 0, 1, 1}, {DELAY_4217, 2974, 0, 1, 1}, {DELAY_2656, 1913, 0, -1, -1},
+     {DELAY_3163, 1996, 0, 1, 1}, {DELAY_4453, 1990, 0, -1, -1}, {DELAY_1800, 187, 0, -1, -1},
+     {DELAY_3720, 1066, 0, -1, -1}},
+    {{DELAY_4453, 353, 0, 1, 1}, {DELAY_4453, 3627, 0, 1, 1}, {DELAY_1800, 1228, 0, -1, -1},
+     {DELAY_3720, 2673, 0, 1, 1}, {DELAY_4217, 2111, 0, -1, -1}, {DELAY_2656, 335, 0, -1, -1},
+     {DELAY_3163, 121, 0, -1, -1}}};
+
+// Taps read at REVERB_QUALITY_REDUCED_TAPS, by their place in a set: one from
+// each of three lines for the left and right outputs, and the first three,
+// already on three lines, of every further set. In true stereo the right
+// output reads its first P loop taps instead, as its other three are on the Q
+// loop the left input feeds. Their gain is raised to keep the level of seven
+// uncorrelated taps
+#define REDUCED_TAPS 3
+static const int reduced_taps[4][REDUCED_TAPS] = {{0, 2, 3}, {4, 5, 6}, {0, 1, 2}, {0, 2, 3}};
+#define REDUCED_TAP_GAIN (0.6 * 1.5275252) // 0.6 * sqrt(7 / 3)
+
+// In true stereo each stereo output weights its four taps on the loop fed by
+// the input on its side by 1.5 and its three on the other loop by 0.5, scaled
+// to keep the level of a centred source: a panned source comes out about 11dB
+// louder on its own side
+#define TRUE_STEREO_NEAR_GAIN 1.2709778 // 1.5 * sqrt(7 / 9.75)
+#define TRUE_STEREO_FAR_GAIN 0.4236593  // 0.5 * sqrt(7 / 9.75)
+
+// Tank lines the extra tap sets are read from, alternating between the loops
+static const int tap_set_lines[6] = {DELAY_4453, DELAY_4217, DELAY_1800, DELAY_2656, DELAY_3720, DELAY_3163};
+
+// Corners of a cube (x front, y left, z up) for the eight tap sets of the
+// ambisonic layout; the first two, the stereo outputs, are front left and right
+static const float ambisonic_directions[8][3] = {{1, 1, 1},   {1, -1, 1},   {1, 1, -1},  {1, -1, -1},
+                                                 {-1, 1, 1},  {-1, -1, 1},  {-1, 1, -1}, {-1, -1, -1}};
+
+// Alignment of the parts of an in-place reverb: a cache line
+#define ARENA_ALIGN 64
+#define ARENA_ROUND(bytes) (((bytes) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// Seconds over which a change of quality is crossfaded
+#define QUALITY_CROSSFADE_TIME 0.03
+
+// Rate the network runs at, after decimation
+static double tank_rate(const DattoroReverb *reverb)
+{
+    return (double)reverb->sample_rate / reverb->decimation;
+}
+
+// Scale the output tap positions to the tank rate. A position past the end
+// of a line shortened by REVERB_SIZE wraps round it, as tap_delay would, so
+// every index is inside its line
+static void scale_output_taps(DattoroReverb *reverb)
+{
+    int decimation = reverb->decimation;
+
+    for (int i = 0; i < reverb->n_tap_sets; i++)
+        for (int j = 0; j < REVERB_OUTPUT_TAPS; j++)
+        {
+            ReverbOutputTap *tap = &reverb->output_taps[i][j];
+            int n_samples = reverb->delay_lines[tap->delay]->n_samples;
+            tap->index = (tap->position + decimation / 2) / decimation;
+            tap->index = n_samples > 0 ? tap->index % n_samples : 0;
+        }
+}
+
+// Set the gain of every output tap from its sign, weighting the stereo
+// outputs toward the loop on their side in true stereo: the Q loop for the
+// left, which the left input feeds, and the P loop for the right
+static void weight_output_taps(DattoroReverb *reverb)
+{
+    for (int i = 0; i < reverb->n_tap_sets; i++)
+        for (int j = 0; j < REVERB_OUTPUT_TAPS; j++)
+        {
+            ReverbOutputTap *tap = &reverb->output_taps[i][j];
+            bool q_loop = tap->delay == DELAY_4217 || tap->delay == DELAY_2656 || tap->delay == DELAY_3163;
+
+            tap->gain = tap->sign;
+            if (reverb->true_stereo && i < 2)
+                tap->gain *= q_loop == (i == 0) ? TRUE_STEREO_NEAR_GAIN : TRUE_STEREO_FAR_GAIN;
+        }
+}
+
+// Read the outputs as the given layout (REVERB_LAYOUT_STEREO by default) from
+// multi_reverb_buffer. The stereo outputs are the first two tap sets in every
+// layout; each further output reads its own set of seven taps, one on each of
+// the tank's delay lines in turn, spread over the line so every set is
+// decorrelated from the others. The network at the old tier of a quality
+// crossfade changes with it, so both give the same outputs to crossfade.
+// Returns false, changing nothing, for an unknown layout
+bool reverb_set_layout(DattoroReverb *reverb, int layout)
+{
+    static const int sources_5_1[6] = {0, 1, 2, -1, 3, 4};
+    static const int sources_7_1[8] = {0, 1, 2, -1, 3, 4, 5, 6};
+
+    if (layout < 0 || layout >= REVERB_LAYOUT_MAX)
+        return false;
+    if (reverb->crossfade)
+        reverb_set_layout(reverb->crossfade, layout);
+    reverb->layout = layout;
+    memset(reverb->output_source, 0, sizeof(reverb->output_source));
+    memset(reverb->output_matrix, 0, sizeof(reverb->output_matrix));
+    switch (layout)
+    {
+    case REVERB_LAYOUT_STEREO:
+        reverb->n_outputs = 2;
+        reverb->n_tap_sets = 2;
+        reverb->output_source[1] = 1;
+        break;
+    case REVERB_LAYOUT_5_1:
+        reverb->n_outputs = 6;
+        reverb->n_tap_sets = 5;
+        memcpy(reverb->output_source, sources_5_1, sizeof(sources_5_1));
+        break;
+    case REVERB_LAYOUT_7_1:
+        reverb->n_outputs = 8;
+        reverb->n_tap_sets = 7;
+        memcpy(reverb->output_source, sources_7_1, sizeof(sources_7_1));
+        break;
+    case REVERB_LAYOUT_AMBISONIC:
+        // encode each tap set as a plane wave from a corner of a cube, scaled
+        // so W has the level of one set
+        reverb->n_outputs = 4;
+        reverb->n_tap_sets = 8;
+        for (int i = 0; i < 8; i++)
+        {
+            float gain = 1.0 / sqrt(8.0), axis = 1.0 / sqrt(3.0);
+            reverb->output_matrix[0][i] = gain;
+            reverb->output_matrix[1][i] = gain * axis * ambisonic_directions[i][1];
+            reverb->output_matrix[2][i] = gain * axis * ambisonic_directions[i][2];
+            reverb->output_matrix[3][i] = gain * axis * ambisonic_directions[i][0];
+        }
+        break;
+    }
+
+    for (int i = 0; i < reverb->n_tap_sets; i++)
+        for (int j = 0; j < REVERB_OUTPUT_TAPS; j++)
+        {
+            ReverbOutputTap *tap = &reverb->output_taps[i][j];
+            int line = tap_set_lines[(i + j) % 6];
+            // golden ratio steps spread the positions of every set over the lines
+            double spread = fmod(0.5 + (REVERB_OUTPUT_TAPS * i + j) * 0.6180339887, 1.0);
+
+            if (i < 2)
+            {
+                *tap = stereo_taps[i][j];
+                continue;
+            }
+            tap->delay = line;
+            tap->position = (int)(delay_times[line] * (0.05 + 0.9 * spread));
+            tap->sign = (i + j) & 1 ? -1 : 1;
+        }
+    scale_output_taps(reverb);
+    weight_output_taps(reverb);
+    update_freeze(reverb);
+    return true;
+}
+
+// Silence a delay line, keeping its length and modulation
+static void clear_delay(DelayLine *delay)
+{
+    int used = delay->used < delay->max_n_samples ? delay->used + 1 : delay->max_n_samples;
+
+    // the rest of the capacity is still silent
+    memset(delay->samples, 0, sizeof(*delay->samples) * used);
+    delay->used = delay->n_samples;
+    delay->allpass_a = 0.0;
+}
+
+// Silence the predelay, filter, input diffusers and decimators of an input
+// (0 left or mixed, 1 right)
+static void clear_input(DattoroReverb *reverb, int input)
+{
+    clear_delay(input ? reverb->pre_delay_r : reverb->pre_delay);
+    for (int i = 0; i < 4; i++)
+        clear_delay(reverb->delay_lines[input_diffusers[input][i]]);
+    *(input ? &reverb->pre_sample_r : &reverb->pre_sample) = 0;
+    if (reverb->multirate)
+        memset(reverb->multirate->decimator[input], 0, sizeof(reverb->multirate->decimator[input]));
+}
+
+// Start recording a frozen tank into a new loop of n_sets tap sets, at the
+// current tank rate
+static ReverbFreeze *create_freeze(const DattoroReverb *reverb, int n_sets)
+{
+    int loop_frames = (int)ceil(FREEZE_LOOP_TIME * tank_rate(reverb));
+    ReverbFreeze *freeze = (ReverbFreeze *)malloc(sizeof(*freeze) + sizeof(*freeze->loop) * loop_frames * n_sets);
+
+    freeze->n_sets = n_sets;
+    freeze->loop_frames = loop_frames;
+    freeze->fade_frames = (int)ceil(FREEZE_FADE_TIME * tank_rate(reverb));
+    freeze->recorded = 0;
+    freeze->position = 0;
+    freeze->release = 0;
+    return freeze;
+}
+
+// Bring the cached loop of a frozen tank up to date after a change to the
+// tank or the freeze: a loop is recorded while frozen with no modulation, and
+// one that has stopped matching the tank is released. An in-place reverb has
+// no room for the loop, so its frozen tank keeps running
+static void update_freeze(DattoroReverb *reverb)
+{
+    ReverbFreeze *freeze = reverb->freeze;
+    bool cached = reverb->frozen && !reverb->in_place && reverb_is_time_invariant(reverb);
+
+    if (!freeze)
+    {
+        if (cached)
+            reverb->freeze = create_freeze(reverb, reverb->n_tap_sets);
+        return;
+    }
+    // so far the loop has only been played as it was recorded, so dropping it is seamless
+    if (freeze->recorded < freeze->loop_frames)
+    {
+        free(freeze);
+        reverb->freeze = cached ? create_freeze(reverb, reverb->n_tap_sets) : NULL;
+        return;
+    }
+    if (freeze->release > 0)
+        return;
+    // a loop still being closed hands back from as far as the crossfade
+    // closing it has got, which it then runs back down
+    if (freeze->recorded < freeze->loop_frames + freeze->fade_frames)
+    {
+        freeze->position = freeze->recorded - freeze->loop_frames;
+        freeze->recorded = freeze->loop_frames + freeze->fade_frames;
+        freeze->release = freeze->position + 1;
+        return;
+    }
+    freeze->release = freeze->fade_frames;
+}
+
+// Resample a cached frozen loop to the tank rate, after a change of
+// decimation by ratio (the new over the old), so that it can still be
+// crossfaded back to the running tank. Going down in rate each frame is the
+// mean of the ones it replaces, as in resample_delay. A loop still being
+// recorded is dropped, which is seamless
+static ReverbFreeze *resample_freeze(const DattoroReverb *reverb, ReverbFreeze *old, double ratio)
+{
+    ReverbFreeze *freeze;
+    int width = ratio > 1.0 ? (int)ratio : 1;
+
+    if (old->recorded < old->loop_frames)
+    {
+        free(old);
+        return NULL;
+    }
+    freeze = create_freeze(reverb, old->n_sets);
+    for (int k = 0; k < freeze->loop_frames; k++)
+        for (int i = 0; i < freeze->n_sets; i++)
+        {
+            double sum = 0.0, t = k * ratio;
+
+            for (int j = 0; j < width; j++)
+            {
+                int a = ((int)t + j) % old->loop_frames;
+                double frac = ratio > 1.0 ? 0.0 : t - (int)t;
+                float x0 = old->loop[a * old->n_sets + i];
+                float x1 = old->loop[(a + 1) % old->loop_frames * old->n_sets + i];
+                sum += x0 + frac * (x1 - x0);
+            }
+            freeze->loop[k * freeze->n_sets + i] = sum / width;
+        }
+    freeze->position = (int)(old->position / ratio) % freeze->loop_frames;
+    freeze->recorded = freeze->loop_frames + freeze->fade_frames;
+    if (old->recorded < old->loop_frames + old->fade_frames)
+        freeze->recorded = freeze->loop_frames +
+                           (int)fmin((old->recorded - old->loop_frames) / ratio, freeze->fade_frames - 1);
+    if (old->release > 0)
+        freeze->release = (int)fmin(fmax(ceil(old->release / ratio), 1.0), freeze->fade_frames);
+    free(old);
+    return freeze;
+}
+
+// Size the right input's predelay and diffusers for the current settings.
+// They only run in true stereo, so are only sized while it is on
+static void size_right_input(DattoroReverb *reverb)
+{
+    double sr_ratio = reverb->params[REVERB_SIZE] * tank_rate(reverb) / 29761.0;
+
+    set_delay(reverb->pre_delay_r, reverb->params[REVERB_PREDELAY] * tank_rate(reverb));
+    for (int i = 0; i < 4; i++)
+        set_delay(reverb->delay_lines[input_diffusers[1][i]], delay_times[input_diffusers[1][i]] * sr_ratio);
+}
+
+// Feed the left input into the Q loop and the right into the P loop, each
+// through its own predelay and input diffusers, rather than their mix into
+// both, and weight each stereo output toward the loop on its side. Keeps the
+// stereo image of the input for the cost of the extra diffusers, not a second
+// tank. The right input path is sized when turned on, which may allocate, and
+// starts silent
+void reverb_set_true_stereo(DattoroReverb *reverb, bool true_stereo)
+{
+    if (reverb->crossfade)
+        reverb_set_true_stereo(reverb->crossfade, true_stereo);
+    if (true_stereo == reverb->true_stereo)
+        return;
+    reverb->true_stereo = true_stereo;
+    if (true_stereo)
+    {
+        size_right_input(reverb);
+        clear_input(reverb, 1);
+        reserve_quality_switch(reverb);
+    }
+    weight_output_taps(reverb);
+    // a cached frozen loop holds the outputs at the old weights
+    update_freeze(reverb);
+}
+
+// Start measuring the level a frozen tank is held to again
+static void reset_frozen_level(DattoroReverb *reverb)
+{
+    reverb->hold_target = 0.0;
+    reverb->hold_level = 0.0;
+    reverb->hold_frames = 0;
+}
+
+// Freeze the reverb: the input section and damping are bypassed and the tank
+// circulates without loss, holding its sound (with modulation, only to within
+// FREEZE_HOLD_MARGIN of its level, see frozen_decay). Without modulation, the tank's
+// output is also recorded into a loop, crossfaded at its ends, which is played
+// back instead of running the tank after FREEZE_LOOP_TIME + FREEZE_FADE_TIME,
+// so a frozen reverb costs little more than its dry mix. Unfreezing crossfades
+// back to the running tank, which decays from where it stopped, with the
+// input section starting silent
+void reverb_set_freeze(DattoroReverb *reverb, bool freeze)
+{
+    if (reverb->crossfade_left > 0)
+        reverb_set_freeze(reverb->crossfade, freeze);
+    if (freeze == reverb->frozen)
+        return;
+    reverb->frozen = freeze;
+    reset_frozen_level(reverb);
+    if (!freeze)
+    {
+        clear_input(reverb, 0);
+        clear_input(reverb, 1);
+    }
+    update_freeze(reverb);
+}
+
+// Set a parameter. Times and frequencies are converted to the tank rate, and
+// the one-pole filter coefficients to give the same time constants there
 void set_reverb_param(DattoroReverb *reverb, int param, double value)
 {
-    const int delay_times[DELAY_MAX] = {142, 379, 107, 277, 672, 908, 4453, 4217, 3720, 3163, 1800, 2656};
+    double sr_ratio, lfo;
+    int decimation = reverb->decimation;
 
-    double sr_ratio;
+    if (param >= 0 && param < REVERB_MAX_PARAMS)
+        reverb->params[param] = value;
     switch (param)
     {
     case REVERB_PREDELAY:
-        set_delay(reverb->pre_delay, value * reverb->sample_rate);
+        set_delay(reverb->pre_delay, value * tank_rate(reverb));
+        if (reverb->true_stereo)
+            set_delay(reverb->pre_delay_r, value * tank_rate(reverb));
         break;
     case REVERB_BANDWIDTH:
         reverb->bandwidth = value / reverb->sample_rate;
+        if (decimation > 1)
+            reverb->bandwidth = 1.0 - pow(1.0 - reverb->bandwidth, decimation);
         break;
     case REVERB_DAMPING:
-        reverb->damping = value;
+        reverb->damping = decimation > 1 ? pow(value, decimation) : value;
         break;
     case REVERB_DECAY:
         reverb->decay = value;
@@ -238,13 +769,19 @@ void set_reverb_param(DattoroReverb *reverb, int param, double value)
         reverb->input_diffusion_2 = value;
         break;
     case REVERB_MODULATION:
-        set_modulation_delay(reverb->delay_lines[DELAY_672], 60.0 * value, 1.25 / reverb->sample_rate);
-        set_modulation_delay(reverb->delay_lines[DELAY_908], 40.0 * value, 4.87 / reverb->sample_rate);
+        // below full quality the modulation is held where it is, rather than
+        // the delays jumping back to their centres, which the tank would
+        // carry on round long after a quality crossfade
+        lfo = reverb->quality >= REVERB_QUALITY_NO_MODULATION ? 0.0 : 1.0;
+        set_modulation_delay(reverb->delay_lines[DELAY_672], 60.0 * value / decimation, lfo * 1.25 / tank_rate(reverb));
+        set_modulation_delay(reverb->delay_lines[DELAY_908], 40.0 * value / decimation, lfo * 4.87 / tank_rate(reverb));
         break;
     case REVERB_SIZE:
-        sr_ratio = value * (reverb->sample_rate) / 29761.0;
-        for (int i = 0; i < DELAY_MAX; i++)
+        sr_ratio = value * tank_rate(reverb) / 29761.0;
+        // the right input diffusers, last, are left for size_right_input
+        for (int i = 0; i < (reverb->true_stereo ? DELAY_MAX : DELAY_142_R); i++)
             set_delay(reverb->delay_lines[i], delay_times[i] * sr_ratio);
+        scale_output_taps(reverb);
         break;
     case REVERB_WET:
         reverb->wet_gain = pow(10.0, value / 20.0);
@@ -253,26 +790,70 @@ void set_reverb_param(DattoroReverb *reverb, int param, double value)
         reverb->dry_gain = pow(10.0, value / 20.0);
         break;
     }
+    // a cached frozen loop no longer matches a changed tank
+    if (param == REVERB_SIZE || param == REVERB_DIFFUSION_1 || param == REVERB_DIFFUSION_2 ||
+        param == REVERB_MODULATION)
+        update_freeze(reverb);
+    reserve_quality_switch(reverb);
 }
 
-// Create a new reverb
-DattoroReverb *create_reverb(int sample_rate)
+// Set up a load meter, disabled and cleared
+static void init_load_meter(ReverbLoadMeter *meter)
 {
-    DattoroReverb *reverb = (DattoroReverb *)malloc(sizeof(*reverb));
-    reverb->pre_delay = create_delay();
+    atomic_init(&meter->enabled, false);
+    atomic_init(&meter->reset, false);
+    atomic_init(&meter->current, 0.0f);
+    atomic_init(&meter->average, 0.0f);
+    atomic_init(&meter->peak, 0.0f);
+    atomic_init(&meter->overruns, 0);
+    atomic_init(&meter->calls, 0);
+}
+
+// Set up a reverb around its delay lines, in the order of reverb_delays, and
+// its load meter, at the full rate and quality. The parameters are left for
+// set_default_reverb
+static void init_reverb(DattoroReverb *reverb, int sample_rate, DelayLine **delays, ReverbLoadMeter *load_meter)
+{
+    reverb_set_delays(reverb, delays);
     reverb->sample_rate = sample_rate;
     reverb->pre_sample = 0;
+    reverb->pre_sample_r = 0;
+    reverb->true_stereo = false;
+    reverb->frozen = false;
+    reverb->freeze = NULL;
+    reset_frozen_level(reverb);
     reverb->diffusion_sample_a = 0;
     reverb->diffusion_sample_b = 0;
+    reverb->load_meter = load_meter;
+    init_load_meter(load_meter);
+    reverb->decimation = 1;
+    reverb->base_decimation = 1;
+    reverb->multirate = NULL;
+    reverb->spare_multirate = NULL;
+    reverb->idle = true;
+    reverb->quality = REVERB_QUALITY_FULL;
+    reverb->next_quality = REVERB_QUALITY_FULL;
+    reverb->crossfade = NULL;
+    reverb->crossfade_frames = 0;
+    reverb->crossfade_left = 0;
+    reverb->in_place = false;
     for (int i = 0; i < DELAY_MAX; i++)
-    {
-        reverb->delay_lines[i] = create_delay();        
         reverb->delay_lines[i]->interpolation_mode = MODDELAY_INTERPOLATION_NONE;
-    }
 
     reverb->delay_lines[DELAY_672]->interpolation_mode = MODDELAY_INTERPOLATION_ALLPASS;
     reverb->delay_lines[DELAY_908]->interpolation_mode = MODDELAY_INTERPOLATION_ALLPASS;
+    reverb_set_layout(reverb, REVERB_LAYOUT_STEREO);
+}
+
+// Create a new reverb
+DattoroReverb *create_reverb(int sample_rate)
+{
+    DattoroReverb *reverb = (DattoroReverb *)malloc(sizeof(*reverb));
+    DelayLine *delays[REVERB_ALL_DELAYS];
 
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        delays[i] = create_delay();
+    init_reverb(reverb, sample_rate, delays, (ReverbLoadMeter *)malloc(sizeof(ReverbLoadMeter)));
     set_default_reverb(reverb);
     return reverb;
 }
@@ -280,126 +861,1607 @@ DattoroReverb *create_reverb(int sample_rate)
 // Destroy a reverb and free all the delay lines
 void destroy_reverb(DattoroReverb *reverb)
 {
-    for (int i = 0; i < DELAY_MAX; i++)
-        destroy_delay(reverb->delay_lines[i]);
+    DelayLine *delays[REVERB_ALL_DELAYS];
+
+    reverb_delays(reverb, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        destroy_delay(delays[i]);
+    free(reverb->multirate);
+    free(reverb->spare_multirate);
+    free(reverb->freeze);
+    if (reverb->crossfade)
+        destroy_reverb(reverb->crossfade);
+    free(reverb->load_meter);
     free(reverb);
 }
 
-float apply_diffusion(DelayLine *delay, float x, float diffusion)
+// Fill the n samples of a delay line, written up to a write head of 0, with
+// old contents (old_n_samples, written up to old_head) resampled by ratio:
+// averaged over each new sample when decimating, linearly interpolated when not
+static void resample_samples(float *samples, int n, const float *old, int old_n_samples, int old_head, double ratio)
 {
-    float y = delay_out(delay);
-    float z = x - y * diffusion;
-    delay_in(delay, z);
-    return y + z * diffusion;
+    for (int age = 0; age < n && old_n_samples > 0; age++)
+    {
+        double sum = 0.0, t = age * ratio;
+        int width = ratio > 1.0 ? (int)ratio : 1;
+
+        for (int k = 0; k < width; k++)
+        {
+            int a = (int)t + k;
+            double frac = ratio > 1.0 ? 0.0 : t - (int)t;
+            float x0 = 0.0f, x1 = 0.0f;
+            if (a < old_n_samples)
+                x0 = old[((old_head - 1 - a) % old_n_samples + old_n_samples) % old_n_samples];
+            if (frac > 0.0 && a + 1 < old_n_samples)
+                x1 = old[((old_head - 2 - a) % old_n_samples + old_n_samples) % old_n_samples];
+            sum += x0 + frac * (x1 - x0);
+        }
+        // the newest sample sits just before write_head, which is 0
+        samples[n - 1 - age] = sum / width;
+    }
 }
 
-// Take a stereo signal and compute the Dattoro reverb of it
-void compute_reverb(DattoroReverb *reverb, float l, float r, float *out_l, float *out_r)
+// Reallocate a delay line to just fit its current length, filling it with
+// its old contents (old_n_samples, written up to old_head) resampled by ratio
+static void resample_delay(DelayLine *delay, int old_n_samples, int old_head, double ratio)
 {
-    float x, y, z, p, q, yl, yr;
+    float *old = delay->samples;
+    int n = delay->n_samples;
 
-    // Initial computation
-    x = (l + r) / 2.0;
-    delay_in(reverb->pre_delay, x);
-    x = delay_out(reverb->pre_delay);
-    x = reverb->bandwidth * x + (1 - reverb->bandwidth) * reverb->pre_sample;
-    reverb->pre_sample = x;
+    delay->max_n_samples = delay_capacity(INIT_DELAY_MAX * 2, n / 2);
+    delay->samples = (float *)calloc(delay->max_n_samples, sizeof(*delay->samples));
+    delay->used = n;
+    resample_samples(delay->samples, n, old, old_n_samples, old_head, ratio);
+    delay->write_head = 0;
+    free(old);
+}
 
-    // Sequential part
+// Refill a delay line in place, at its current length, with the contents of
+// src resampled by ratio. It must already have room for its length, so
+// nothing is allocated
+static void resample_delay_from(DelayLine *delay, const DelayLine *src, double ratio)
+{
+    int n = delay->n_samples;
+    int used = delay->used < delay->max_n_samples ? delay->used + 1 : delay->max_n_samples;
 
-    // delay line 142
-    x = apply_diffusion(reverb->delay_lines[DELAY_142], x, reverb->input_diffusion_1);
-    x = apply_diffusion(reverb->delay_lines[DELAY_107], x, reverb->input_diffusion_1);
-    x = apply_diffusion(reverb->delay_lines[DELAY_379], x, reverb->input_diffusion_2);
-    x = apply_diffusion(reverb->delay_lines[DELAY_277], x, reverb->input_diffusion_2);
+    resample_samples(delay->samples, n, src->samples, src->n_samples, src->write_head, ratio);
+    // past the new length, only what has held signal needs silencing
+    if (used > n)
+        memset(delay->samples + n, 0, sizeof(*delay->samples) * (used - n));
+    delay->used = n;
+    delay->write_head = 0;
+}
 
-    p = reverb->decay * delay_out(reverb->delay_lines[DELAY_3720]) + x;
-    q = reverb->decay * delay_out(reverb->delay_lines[DELAY_3163]) + x;
+// Resampling filters for a reverb starting to decimate, cleared: the ones it
+// set aside, if any, or new ones
+static ReverbMultirate *take_multirate(DattoroReverb *reverb)
+{
+    ReverbMultirate *multirate = reverb->spare_multirate;
 
-    // P Loop
-    // delay line 672
-    y = delay_out(reverb->delay_lines[DELAY_672]);
-    z = p - y * reverb->decay_diffusion_1;
-    delay_in(reverb->delay_lines[DELAY_672], z);
-    p = y + z * reverb->decay_diffusion_1;
+    if (!multirate)
+        multirate = (ReverbMultirate *)malloc(sizeof(*multirate));
+    reverb->spare_multirate = NULL;
+    memset(multirate, 0, sizeof(*multirate));
+    return multirate;
+}
 
-    // delay/filter 4453
-    p = delay_out(reverb->delay_lines[DELAY_4453]);
-    p = (1 - reverb->damping) * p + reverb->damping * reverb->diffusion_sample_a;
-    reverb->diffusion_sample_a = p;
+// Stop decimating, setting the resampling filters aside for the next time
+// rather than freeing them
+static void park_multirate(DattoroReverb *reverb)
+{
+    if (!reverb->multirate)
+        return;
+    if (reverb->spare_multirate)
+        free(reverb->multirate);
+    else
+        reverb->spare_multirate = reverb->multirate;
+    reverb->multirate = NULL;
+}
 
-    p = p * reverb->decay;
+// Decimation of the tank for a base decimation at a quality tier
+static int quality_decimation(int decimation, int quality)
+{
+    if (quality >= REVERB_QUALITY_HALF_RATE && decimation < 4)
+        decimation *= 2;
+    return decimation;
+}
 
-    // delay line 1800
-    p = apply_diffusion(reverb->delay_lines[DELAY_1800], p, reverb->decay_diffusion_2);
+// Rerun the network at the decimation given by the base decimation and the
+// quality. Parameters are reapplied at the new rate, and the delay lines are
+// resized to fit (so shrink when decimating) with their contents resampled,
+// so the tail carries on. Given a source, a copy of the network from before
+// the change, the lines are resampled from it in place instead, which only
+// allocates if they lack room for the new rate (see reserve_quality_switch)
+static void update_decimation(DattoroReverb *reverb, const DattoroReverb *source)
+{
+    DelayLine *delays[REVERB_ALL_DELAYS], *sources[REVERB_ALL_DELAYS];
+    int old_n_samples[REVERB_ALL_DELAYS], old_head[REVERB_ALL_DELAYS];
+    int old_decimation = reverb->decimation;
+    int decimation = quality_decimation(reverb->base_decimation, reverb->quality);
 
-    // delay line 3720
-    delay_in(reverb->delay_lines[DELAY_3720], p);
+    if (decimation == old_decimation)
+        return;
 
-    // Q loop
-    // delay line 908
-    y = delay_out(reverb->delay_lines[DELAY_908]);
-    z = q - y * reverb->decay_diffusion_1;
-    delay_in(reverb->delay_lines[DELAY_908], z);
-    q = y + z * reverb->decay_diffusion_1;
+    reverb->decimation = decimation;
+    // a cached frozen loop is at the old rate
+    if (reverb->freeze)
+        reverb->freeze = resample_freeze(reverb, reverb->freeze, (double)decimation / old_decimation);
+    park_multirate(reverb);
+    if (decimation > 1)
+        reverb->multirate = take_multirate(reverb);
 
-    // delay/filter 4217
-    delay_in(reverb->delay_lines[DELAY_4217], q);
-    q = delay_out(reverb->delay_lines[DELAY_4217]);
-    q = (1 - reverb->damping) * q + reverb->damping * reverb->diffusion_sample_b;
-    reverb->diffusion_sample_b = q;
+    reverb_delays(reverb, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+    {
+        old_n_samples[i] = delays[i]->n_samples;
+        old_head[i] = delays[i]->write_head;
+    }
+    for (int i = 0; i < REVERB_MAX_PARAMS; i++)
+        set_reverb_param(reverb, i, reverb->params[i]);
+    // the modulation extent is limited by the delay lengths, now final
+    set_reverb_param(reverb, REVERB_MODULATION, reverb->params[REVERB_MODULATION]);
+    if (source)
+    {
+        reverb_delays(source, sources);
+        for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+            resample_delay_from(delays[i], sources[i], (double)decimation / old_decimation);
+    }
+    else
+    {
+        for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+            resample_delay(delays[i], old_n_samples[i], old_head[i], (double)decimation / old_decimation);
+    }
+    update_freeze(reverb);
+}
 
-    q = q * reverb->decay;
+// Run the network at sample_rate / decimation (1, 2 or 4), with the input
+// decimated and the wet output interpolated back up by half-band filters.
+// At REVERB_QUALITY_HALF_RATE the tank runs at half this rate again, down to
+// a quarter of the sample rate. Returns false, changing nothing, for any other
+// factor, or one that would change the tank rate of an in-place reverb
+bool reverb_set_decimation(DattoroReverb *reverb, int decimation)
+{
+    if (decimation != 1 && decimation != 2 && decimation != 4)
+        return false;
+    if (reverb->in_place && quality_decimation(decimation, reverb->quality) != reverb->decimation)
+        return false;
+    reverb->base_decimation = decimation;
+    update_decimation(reverb, NULL);
+    // a waiting quality switch will now be to a different rate
+    reserve_quality_switch(reverb);
+    return true;
+}
 
-    // delay line 2656
-    q = apply_diffusion(reverb->delay_lines[DELAY_2656], q, reverb->decay_diffusion_2);
+// Capacity the delay line at index i of reverb_delays reaches at a tank rate,
+// with the defaults applied by create_reverb and REVERB_SIZE up to max_size
+// and REVERB_PREDELAY up to max_predelay seconds, as delay lines never shrink
+static int line_capacity(int i, double rate, double max_size, double max_predelay)
+{
+    int capacity;
 
-    // delay line 3720
-    delay_in(reverb->delay_lines[DELAY_3163], q);
+    // left and right predelays, then the network
+    if (i < 2)
+    {
+        capacity = delay_capacity(INIT_DELAY_MAX * 2, 0.001 * rate);
+        return delay_capacity(capacity, max_predelay * rate);
+    }
+    capacity = delay_capacity(INIT_DELAY_MAX * 2, delay_times[i - 2] * (1.0 * rate / 29761.0));
+    return delay_capacity(capacity, delay_times[i - 2] * (max_size * rate / 29761.0));
+}
+
+// Bytes of memory a reverb created at sample_rate will use, if REVERB_SIZE
+// never exceeds max_size and REVERB_PREDELAY never exceeds max_predelay
+// seconds, with true stereo on (the right input's lines stay small otherwise)
+size_t reverb_memory_bytes(int sample_rate, double max_size, double max_predelay)
+{
+    size_t bytes = sizeof(DattoroReverb) + sizeof(ReverbLoadMeter) + REVERB_ALL_DELAYS * sizeof(DelayLine);
+
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        bytes += line_capacity(i, sample_rate, max_size, max_predelay) * sizeof(float);
+    return bytes;
+}
+
+// Offsets of the parts of an in-place reverb in its memory, each starting on
+// a cache line: the reverb, its load meter, resampling filters (if
+// decimating), delay lines, and the samples of each line
+typedef struct ReverbArena
+{
+    size_t load_meter;
+    size_t multirate;
+    size_t delays;
+    size_t samples[REVERB_ALL_DELAYS];
+    int capacity[REVERB_ALL_DELAYS];
+    size_t bytes;
+} ReverbArena;
 
-    // left taps
-    yl = 0.6 * tap_delay(reverb->delay_lines[DELAY_4217], 266);
-    yl += 0.6 * tap_delay(reverb->delay_lines[DELAY_4217], 2974);
-    yl -= 0.6 * tap_delay(reverb->delay_lines[DELAY_2656], 1913);
-    yl += 0.6 * tap_delay(reverb->delay_lines[DELAY_3163], 1996);
-    yl -= 0.6 * tap_delay(reverb->delay_lines[DELAY_4453], 1990);
-    yl -= 0.6 * tap_delay(reverb->delay_lines[DELAY_1800], 187);
-    yl -= 0.6 * tap_delay(reverb->delay_lines[DELAY_3720], 1066);
+static bool arena_layout(const ReverbConfig *config, ReverbArena *arena)
+{
+    int decimation;
+    size_t bytes;
 
-    // right taps
-    yr = 0.6 * tap_delay(reverb->delay_lines[DELAY_4453], 353);
-    yr += 0.6 * tap_delay(reverb->delay_lines[DELAY_4453], 3627);
-    yr -= 0.6 * tap_delay(reverb->delay_lines[DELAY_1800], 1228);
-    yr += 0.6 * tap_delay(reverb->delay_lines[DELAY_3720], 2673);
-    yr -= 0.6 * tap_delay(reverb->delay_lines[DELAY_4217], 2111);
-    yr -= 0.6 * tap_delay(reverb->delay_lines[DELAY_2656], 335);
-    yr -= 0.6 * tap_delay(reverb->delay_lines[DELAY_3163], 121);
+    if (config->sample_rate <= 0 || !(config->max_size >= 0.0) || !(config->max_predelay >= 0.0) ||
+        (config->decimation != 1 && config->decimation != 2 && config->decimation != 4) ||
+        config->quality < REVERB_QUALITY_FULL || config->quality >= REVERB_QUALITY_MAX)
+        return false;
+    decimation = quality_decimation(config->decimation, config->quality);
 
-    *out_l = yl;
-    *out_r = yr;
+    bytes = ARENA_ROUND(sizeof(DattoroReverb));
+    arena->load_meter = bytes;
+    bytes += ARENA_ROUND(sizeof(ReverbLoadMeter));
+    arena->multirate = bytes;
+    if (decimation > 1)
+        bytes += ARENA_ROUND(sizeof(ReverbMultirate));
+    arena->delays = bytes;
+    bytes += ARENA_ROUND(REVERB_ALL_DELAYS * sizeof(DelayLine));
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+    {
+        arena->capacity[i] = line_capacity(i, (double)config->sample_rate / decimation, config->max_size,
+                                           config->max_predelay);
+        arena->samples[i] = bytes;
+        bytes += ARENA_ROUND(arena->capacity[i] * sizeof(float));
+    }
+    arena->bytes = bytes;
+    return true;
 }
 
-void mono_reverb_buffer(DattoroReverb *reverb, float *buffer, int bufferLen)
+// Bytes of memory reverb_init_in_place needs for a reverb with a given
+// configuration, 0 if the configuration is invalid
+size_t reverb_required_bytes(const ReverbConfig *config)
 {
-    int i;
-    float l, r;
-    for (i = 0; i < bufferLen; i++)
+    ReverbArena arena;
+
+    return arena_layout(config, &arena) ? arena.bytes : 0;
+}
+
+// Lay out a reverb with the default settings in bytes of caller memory,
+// aligned as from malloc, without allocating; returns NULL if the memory is
+// too small or the configuration invalid. The reverb never allocates:
+//  - REVERB_SIZE and REVERB_PREDELAY beyond the configured maxima are cut
+//    to the longest delays that fit
+//  - the tank rate is fixed, so reverb_set_decimation and reverb_set_quality
+//    refuse changes to it, and quality changes are not crossfaded
+//  - a frozen tank keeps running rather than playing a cached loop
+// It is not destroyed: reverb_reset returns it to silence for reuse, and
+// the memory is the caller's to free or reuse once the reverb is done with.
+// Calling this again on the same memory starts afresh at the defaults
+DattoroReverb *reverb_init_in_place(void *mem, size_t bytes, const ReverbConfig *config)
+{
+    unsigned char *base = (unsigned char *)mem;
+    DattoroReverb *reverb = (DattoroReverb *)mem;
+    DelayLine *lines, *delays[REVERB_ALL_DELAYS];
+    ReverbArena arena;
+
+    if (!mem || !arena_layout(config, &arena) || bytes < arena.bytes)
+        return NULL;
+    lines = (DelayLine *)(base + arena.delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+    {
+        float *samples = (float *)(base + arena.samples[i]);
+        memset(samples, 0, sizeof(*samples) * arena.capacity[i]);
+        init_delay(&lines[i], samples, arena.capacity[i]);
+        lines[i].fixed_capacity = 1;
+        delays[i] = &lines[i];
+    }
+    init_reverb(reverb, config->sample_rate, delays, (ReverbLoadMeter *)(base + arena.load_meter));
+    reverb->in_place = true;
+    reverb->base_decimation = config->decimation;
+    reverb->quality = config->quality;
+    reverb->next_quality = config->quality;
+    reverb->decimation = quality_decimation(config->decimation, config->quality);
+    if (reverb->decimation > 1)
+    {
+        reverb->multirate = (ReverbMultirate *)(base + arena.multirate);
+        memset(reverb->multirate, 0, sizeof(*reverb->multirate));
+    }
+    set_default_reverb(reverb);
+    return reverb;
+}
+
+// Bytes of memory currently used by a reverb instance
+size_t reverb_instance_bytes(const DattoroReverb *reverb)
+{
+    size_t bytes = sizeof(*reverb);
+    DelayLine *delays[REVERB_ALL_DELAYS];
+
+    reverb_delays(reverb, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        bytes += sizeof(DelayLine) + delays[i]->max_n_samples * sizeof(float);
+    if (reverb->multirate)
+        bytes += sizeof(*reverb->multirate);
+    if (reverb->spare_multirate)
+        bytes += sizeof(*reverb->spare_multirate);
+    if (reverb->freeze)
+        bytes += freeze_bytes(reverb->freeze);
+    if (reverb->crossfade)
+        bytes += reverb_instance_bytes(reverb->crossfade);
+    return bytes + sizeof(*reverb->load_meter);
+}
+
+// Make one delay line an exact copy of another, contents included
+static void copy_delay(DelayLine *dst, const DelayLine *src)
+{
+    float *samples = dst->samples;
+    int max_n_samples = dst->max_n_samples, fixed_capacity = dst->fixed_capacity;
+
+    if (max_n_samples < src->n_samples + 1)
     {
-        compute_reverb(reverb, buffer[i], buffer[i], &l, &r);
-        buffer[i] = reverb->dry_gain * buffer[i] + reverb->wet_gain * l;
+        max_n_samples = src->n_samples + 1;
+        samples = (float *)realloc(samples, sizeof(*samples) * max_n_samples);
     }
+    *dst = *src;
+    dst->samples = samples;
+    dst->max_n_samples = max_n_samples;
+    dst->fixed_capacity = fixed_capacity;
+    dst->used = src->n_samples;
+    memcpy(dst->samples, src->samples, sizeof(*src->samples) * src->n_samples);
+    memset(dst->samples + src->n_samples, 0, sizeof(*dst->samples) * (max_n_samples - src->n_samples));
 }
 
-// assumes interleaved stereo
-void stereo_reverb_buffer(DattoroReverb *reverb, float *buffer, int bufferLen)
+// Make dst an exact copy of src's network: settings, quality, delay line
+// contents and filter memories. dst's own crossfade and load meter are kept.
+// dst must not be in place
+static void copy_reverb(DattoroReverb *dst, const DattoroReverb *src)
 {
-    int i;
-    float l, r;
+    DattoroReverb saved = *dst;
 
-    for (i = 0; i < bufferLen; i += 2)
+    *dst = *src;
+    dst->pre_delay = saved.pre_delay;
+    dst->pre_delay_r = saved.pre_delay_r;
+    memcpy(dst->delay_lines, saved.delay_lines, sizeof(dst->delay_lines));
+    dst->multirate = saved.multirate;
+    dst->spare_multirate = saved.spare_multirate;
+    dst->freeze = saved.freeze;
+    dst->crossfade = saved.crossfade;
+    dst->crossfade_left = saved.crossfade_left;
+    dst->crossfade_frames = saved.crossfade_frames;
+    dst->load_meter = saved.load_meter;
+    dst->in_place = saved.in_place;
+
+    copy_delay(dst->pre_delay, src->pre_delay);
+    copy_delay(dst->pre_delay_r, src->pre_delay_r);
+    for (int i = 0; i < DELAY_MAX; i++)
+        copy_delay(dst->delay_lines[i], src->delay_lines[i]);
+    if (!src->multirate)
+        park_multirate(dst);
+    else
+    {
+        if (!dst->multirate)
+            dst->multirate = take_multirate(dst);
+        *dst->multirate = *src->multirate;
+    }
+    free(dst->freeze);
+    dst->freeze = NULL;
+    if (src->freeze)
+    {
+        dst->freeze = (ReverbFreeze *)malloc(freeze_bytes(src->freeze));
+        memcpy(dst->freeze, src->freeze, freeze_bytes(src->freeze));
+    }
+}
+
+// Create a new, silent reverb with the same settings as an existing one
+static DattoroReverb *create_reverb_like(const DattoroReverb *reverb)
+{
+    DattoroReverb *copy = create_reverb(reverb->sample_rate);
+
+    copy_reverb(copy, reverb);
+    reverb_clear(copy);
+    if (copy->multirate)
+        copy->multirate->phase = 0;
+    return copy;
+}
+
+// Create an exact copy of a reverb, mid-stream: settings, delay line contents,
+// modulation phases, filter memories, a frozen loop and any crossfade in
+// progress, so the copy carries on exactly as the original would. A warmed up
+// reverb can be cloned for variants without rendering its warm up again. A
+// load meter, if enabled, starts afresh
+DattoroReverb *reverb_clone(const DattoroReverb *reverb)
+{
+    DattoroReverb *clone = create_reverb(reverb->sample_rate);
+
+    copy_reverb(clone, reverb);
+    if (reverb->crossfade_left > 0)
+    {
+        clone->crossfade = reverb_clone(reverb->crossfade);
+        clone->crossfade_frames = reverb->crossfade_frames;
+        clone->crossfade_left = reverb->crossfade_left;
+    }
+    if (atomic_load_explicit(&reverb->load_meter->enabled, memory_order_relaxed))
+        reverb_enable_load_meter(clone, true);
+    return clone;
+}
+
+// True if no delay line is modulating (a held modulation reads a fixed
+// point), so the reverb is a linear time-invariant system, fully described by
+// its impulse response
+bool reverb_is_time_invariant(const DattoroReverb *reverb)
+{
+    DelayLine *delays[REVERB_ALL_DELAYS];
+
+    reverb_delays(reverb, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        if (delays[i]->modulated && delays[i]->modulation_extent != 0.0 && delays[i]->modulation_frequency != 0.0)
+            return false;
+    return true;
+}
+
+// Seconds after the input stops until the output has fallen level_db below the
+// input's level: the delay into the tank, a trip round its longest loop, then
+// the decay of the loop gain (decay squared) on each further trip. Delays are
+// the read offsets, half the length of each delay line's buffer, and the tank
+// starts from the 1 / (1 - decay^2) that sustained input can build it up to.
+// An estimate: damping shortens the real tail, but the allpasses in the loops
+// hold some frequencies back for longer than their delays, which lengthens
+// it. A level_db of -INFINITY gives the time to pass through the predelay and
+// once round the tank. Infinite if decay is 1 or more
+double reverb_tail_seconds(const DattoroReverb *reverb, double level_db)
+{
+    double input = reverb->pre_delay->read_offset;
+    double loop_p = 0.0, loop_q = 0.0, gain_db;
+    const int input_delays[] = {DELAY_142, DELAY_107, DELAY_379, DELAY_277};
+    const int p_delays[] = {DELAY_672, DELAY_4453, DELAY_1800, DELAY_3720};
+    const int q_delays[] = {DELAY_908, DELAY_4217, DELAY_2656, DELAY_3163};
+
+    for (int i = 0; i < 4; i++)
+    {
+        input += reverb->delay_lines[input_delays[i]]->read_offset;
+        loop_p += reverb->delay_lines[p_delays[i]]->read_offset;
+        loop_q += reverb->delay_lines[q_delays[i]]->read_offset;
+    }
+    if (reverb->decay >= 1.0 || reverb->frozen)
+        return INFINITY;
+    if (reverb->decay <= 0.0)
+        return (input + fmax(loop_p, loop_q)) / tank_rate(reverb);
+    // the seven output taps of 0.6 can sum to 4.2 times the level in the tank
+    gain_db = 20.0 * log10(4.2 * reverb->wet_gain / (1.0 - reverb->decay * reverb->decay));
+    return (input + fmax(loop_p, loop_q) * (1.0 + fmax(level_db + gain_db, 0.0) / (-40.0 * log10(reverb->decay)))) /
+           tank_rate(reverb);
+}
+
+// Render the wet (ungained) response to a unit impulse on both inputs, for the
+// current settings, into ir_l and ir_r. The reverb itself is not disturbed.
+void reverb_impulse_response(const DattoroReverb *reverb, float *ir_l, float *ir_r, int n_frames)
+{
+    DattoroReverb *scratch = create_reverb_like(reverb);
+
+    for (int i = 0; i < n_frames; i++)
+    {
+        float x = (i == 0) ? 1.0 : 0.0, out[2];
+        reverb_frame(scratch, x, x, out, false);
+        ir_l[i] = out[0];
+        ir_r[i] = out[1];
+    }
+    destroy_reverb(scratch);
+}
+
+// Silence a reverb: clear all delay lines and filter memories, keeping the
+// settings and the modulation phase
+void reverb_clear(DattoroReverb *reverb)
+{
+    DelayLine *delays[REVERB_ALL_DELAYS];
+
+    reverb_delays(reverb, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        clear_delay(delays[i]);
+    reverb->pre_sample = 0;
+    reverb->pre_sample_r = 0;
+    reverb->diffusion_sample_a = 0;
+    reverb->diffusion_sample_b = 0;
+    reverb->crossfade_left = 0;
+    reverb->idle = true;
+    if (reverb->multirate)
+    {
+        int phase = reverb->multirate->phase;
+        memset(reverb->multirate, 0, sizeof(*reverb->multirate));
+        reverb->multirate->phase = phase;
+    }
+    // a frozen loop starts again, recording the silent tank
+    reset_frozen_level(reverb);
+    if (reverb->freeze)
+    {
+        reverb->freeze->recorded = 0;
+        reverb->freeze->position = 0;
+        reverb->freeze->release = 0;
+    }
+    // with nothing left to crossfade from, a waiting quality switch is made now
+    if (reverb->next_quality != reverb->quality)
+        switch_quality(reverb, reverb->next_quality);
+}
+
+// Return a reverb to the state it had when created: silent, with the
+// modulation at phase zero, but keeping its current settings
+void reverb_reset(DattoroReverb *reverb)
+{
+    DelayLine *delays[REVERB_ALL_DELAYS];
+
+    reverb_clear(reverb);
+    reverb_delays(reverb, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+    {
+        delays[i]->phase = 0.0;
+        delays[i]->excursion = 0;
+    }
+    if (reverb->multirate)
+        reverb->multirate->phase = 0;
+}
+
+// Advance the modulation of a delay line exactly as n_frames calls of delay_in would
+static void skip_modulation_delay(DelayLine *delay, long n_frames)
+{
+    if (!delay->modulated || delay->modulation_frequency == 0.0 || n_frames <= 0)
+        return;
+    for (long i = 0; i < n_frames; i++)
+        delay->phase += (2 * M_PI * delay->modulation_frequency);
+    update_excursion(delay);
+}
+
+// Advance the modulation LFOs as if n_frames frames had been processed,
+// without touching the audio state. Together with reverb_clear, this gives the
+// state a reverb would have at a later time had its input been silent
+void reverb_skip_modulation(DattoroReverb *reverb, long n_frames)
+{
+    DelayLine *delays[REVERB_ALL_DELAYS];
+
+    if (reverb->crossfade_left > 0 && n_frames > 0)
+    {
+        reverb_skip_modulation(reverb->crossfade, n_frames);
+        reverb->crossfade_left = n_frames < reverb->crossfade_left ? reverb->crossfade_left - n_frames : 0;
+    }
+    // a decimated tank steps once every decimation frames
+    if (reverb->multirate && n_frames > 0)
+    {
+        long frames = reverb->multirate->phase + n_frames;
+        reverb->multirate->phase = frames % reverb->decimation;
+        n_frames = frames / reverb->decimation;
+    }
+    reverb_delays(reverb, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        skip_modulation_delay(delays[i], n_frames);
+}
+
+#define STATE_MAGIC 0x42565244 // "DRVB"
+#define STATE_VERSION 8
+
+// Cursor over a state blob; reads and writes past the end are dropped and flagged.
+// A writer with no data just counts the bytes, and a reader that is only
+// checking a blob passes over the delay line samples
+typedef struct StateCursor
+{
+    unsigned char *data;
+    size_t size;
+    size_t pos;
+    bool overflow;
+    bool check;
+} StateCursor;
+
+static void state_put(StateCursor *cursor, const void *value, size_t bytes)
+{
+    if (!cursor->data)
+    {
+        cursor->pos += bytes;
+        return;
+    }
+    if (cursor->overflow || cursor->pos + bytes > cursor->size)
+    {
+        cursor->overflow = true;
+        return;
+    }
+    memcpy(cursor->data + cursor->pos, value, bytes);
+    cursor->pos += bytes;
+}
+
+static void state_skip(StateCursor *cursor, size_t bytes)
+{
+    if (cursor->overflow || cursor->pos + bytes > cursor->size)
+        cursor->overflow = true;
+    else
+        cursor->pos += bytes;
+}
+
+static void state_get(StateCursor *cursor, void *value, size_t bytes)
+{
+    if (cursor->overflow || cursor->pos + bytes > cursor->size)
+    {
+        cursor->overflow = true;
+        memset(value, 0, bytes);
+        return;
+    }
+    memcpy(value, cursor->data + cursor->pos, bytes);
+    cursor->pos += bytes;
+}
+
+#define STATE_FIELD(cursor, op, field) op(cursor, &(field), sizeof(field))
+
+// Save or load everything but the samples of a delay line
+#define DELAY_STATE_FIELDS(cursor, op, delay)            \
+    do                                                   \
+    {                                                    \
+        STATE_FIELD(cursor, op, (delay)->n_samples);     \
+        STATE_FIELD(cursor, op, (delay)->read_offset);   \
+        STATE_FIELD(cursor, op, (delay)->read_head);     \
+        STATE_FIELD(cursor, op, (delay)->write_head);    \
+        STATE_FIELD(cursor, op, (delay)->read_fraction); \
+        STATE_FIELD(cursor, op, (delay)->excursion);     \
+        STATE_FIELD(cursor, op, (delay)->phase);         \
+        STATE_FIELD(cursor, op, (delay)->modulation_frequency); \
+        STATE_FIELD(cursor, op, (delay)->modulation_extent);    \
+        STATE_FIELD(cursor, op, (delay)->interpolation_mode);   \
+        STATE_FIELD(cursor, op, (delay)->feedback);      \
+        STATE_FIELD(cursor, op, (delay)->modulated);     \
+        STATE_FIELD(cursor, op, (delay)->allpass_a);     \
+        STATE_FIELD(cursor, op, (delay)->sample_rate);   \
+    } while (0)
+
+// Save or load the settings and filter memories of a reverb
+#define REVERB_STATE_FIELDS(cursor, op, reverb)               \
+    do                                                        \
+    {                                                         \
+        STATE_FIELD(cursor, op, (reverb)->bandwidth);         \
+        STATE_FIELD(cursor, op, (reverb)->damping);           \
+        STATE_FIELD(cursor, op, (reverb)->decay);             \
+        STATE_FIELD(cursor, op, (reverb)->decay_diffusion_1); \
+        STATE_FIELD(cursor, op, (reverb)->decay_diffusion_2); \
+        STATE_FIELD(cursor, op, (reverb)->input_diffusion_1); \
+        STATE_FIELD(cursor, op, (reverb)->input_diffusion_2); \
+        STATE_FIELD(cursor, op, (reverb)->max_excursion_1);   \
+        STATE_FIELD(cursor, op, (reverb)->max_excursion_2);   \
+        STATE_FIELD(cursor, op, (reverb)->pre_sample);        \
+        STATE_FIELD(cursor, op, (reverb)->pre_sample_r);      \
+        STATE_FIELD(cursor, op, (reverb)->diffusion_sample_a); \
+        STATE_FIELD(cursor, op, (reverb)->diffusion_sample_b); \
+        STATE_FIELD(cursor, op, (reverb)->wet_gain);          \
+        STATE_FIELD(cursor, op, (reverb)->dry_gain);          \
+        STATE_FIELD(cursor, op, (reverb)->true_stereo);       \
+        STATE_FIELD(cursor, op, (reverb)->frozen);            \
+        STATE_FIELD(cursor, op, (reverb)->idle);              \
+        STATE_FIELD(cursor, op, (reverb)->hold_target);       \
+        STATE_FIELD(cursor, op, (reverb)->hold_level);        \
+        STATE_FIELD(cursor, op, (reverb)->hold_frames);       \
+        STATE_FIELD(cursor, op, (reverb)->layout);            \
+        STATE_FIELD(cursor, op, (reverb)->n_outputs);         \
+        STATE_FIELD(cursor, op, (reverb)->n_tap_sets);        \
+        STATE_FIELD(cursor, op, (reverb)->output_taps);       \
+        STATE_FIELD(cursor, op, (reverb)->output_source);     \
+        STATE_FIELD(cursor, op, (reverb)->output_matrix);     \
+        STATE_FIELD(cursor, op, (reverb)->params);            \
+    } while (0)
+
+// Check a loaded output layout only reads taps that exist, inside their lines
+static bool valid_outputs(const DattoroReverb *reverb)
+{
+    if (reverb->layout < 0 || reverb->layout >= REVERB_LAYOUT_MAX || reverb->n_outputs < 0 ||
+        reverb->n_outputs > REVERB_MAX_OUTPUTS || reverb->n_tap_sets < 0 || reverb->n_tap_sets > REVERB_MAX_OUTPUTS)
+        return false;
+    for (int i = 0; i < reverb->n_outputs; i++)
+        if (reverb->output_source[i] >= reverb->n_tap_sets)
+            return false;
+    for (int i = 0; i < reverb->n_tap_sets; i++)
+        for (int j = 0; j < REVERB_OUTPUT_TAPS; j++)
+        {
+            const ReverbOutputTap *tap = &reverb->output_taps[i][j];
+            if (tap->delay < 0 || tap->delay >= DELAY_MAX || tap->index < 0)
+                return false;
+            // a zero length line is only ever read at 0
+            if (tap->index >= reverb->delay_lines[tap->delay]->n_samples && tap->index > 0)
+                return false;
+        }
+    return true;
+}
+
+// Check a loaded delay line only reads and writes inside its samples. The
+// write head is inside the line, and delay_out reads read_offset + excursion
+// and one more sample on from it, wrapping once, so both must also be inside
+// it. A zero length line writes and reads its first two samples
+static bool valid_delay(const DelayLine *delay)
+{
+    int reach = delay->read_offset + delay->excursion;
+
+    if (delay->n_samples == 0)
+        return delay->write_head == 0 && reach == 0 && delay->max_n_samples >= 2;
+    return delay->n_samples > 0 && delay->write_head >= 0 && delay->write_head < delay->n_samples && reach >= 0 &&
+           reach + 1 <= delay->n_samples;
+}
+
+// Check a loaded half-band filter only indexes inside its history
+static bool valid_halfband(const HalfBand *hb)
+{
+    return hb->pos >= 0 && hb->pos < HALFBAND_HISTORY;
+}
+
+// Check loaded resampling filters, and that the frames since the last tank
+// step are fewer than the decimation
+static bool valid_multirate(const ReverbMultirate *mr, int decimation)
+{
+    for (int j = 0; j < 2; j++)
+    {
+        for (int i = 0; i < 2; i++)
+            if (!valid_halfband(&mr->decimator[i][j]))
+                return false;
+        for (int c = 0; c < REVERB_MAX_OUTPUTS; c++)
+            if (!valid_halfband(&mr->interpolator[c][j]))
+                return false;
+    }
+    return mr->phase >= 0 && mr->phase < decimation;
+}
+
+// A loaded bool must hold 0 or 1
+static bool valid_bool(const bool *value)
+{
+    unsigned char byte;
+
+    memcpy(&byte, value, 1);
+    return byte <= 1;
+}
+
+// Write (or with data NULL, just measure) the full state of a reverb
+static void put_state(StateCursor *c, const DattoroReverb *reverb)
+{
+    DelayLine *delays[REVERB_ALL_DELAYS];
+    uint32_t magic = STATE_MAGIC, version = STATE_VERSION;
+    int n_delays = REVERB_ALL_DELAYS;
+    bool cached = reverb->freeze != NULL;
+
+    reverb_delays(reverb, delays);
+
+    state_put(c, &magic, sizeof(magic));
+    state_put(c, &version, sizeof(version));
+    STATE_FIELD(c, state_put, reverb->sample_rate);
+    STATE_FIELD(c, state_put, n_delays);
+    STATE_FIELD(c, state_put, reverb->decimation);
+    STATE_FIELD(c, state_put, reverb->base_decimation);
+    STATE_FIELD(c, state_put, reverb->quality);
+    REVERB_STATE_FIELDS(c, state_put, reverb);
+    if (reverb->multirate)
+        state_put(c, reverb->multirate, sizeof(*reverb->multirate));
+    STATE_FIELD(c, state_put, cached);
+    if (cached)
+        state_put(c, reverb->freeze, freeze_bytes(reverb->freeze));
+    for (int i = 0; i < n_delays; i++)
+    {
+        const DelayLine *delay = delays[i];
+        DELAY_STATE_FIELDS(c, state_put, delay);
+        state_put(c, delay->samples, sizeof(*delay->samples) * delay->n_samples);
+    }
+    // a crossfade in progress carries on from the old network, saved whole
+    STATE_FIELD(c, state_put, reverb->crossfade_frames);
+    STATE_FIELD(c, state_put, reverb->crossfade_left);
+    STATE_FIELD(c, state_put, reverb->next_quality);
+    if (reverb->crossfade_left > 0)
+        put_state(c, reverb->crossfade);
+}
+
+static size_t write_state(const DattoroReverb *reverb, void *data, size_t bytes)
+{
+    StateCursor cursor = {(unsigned char *)data, bytes, 0, false, false};
+
+    put_state(&cursor, reverb);
+    return cursor.overflow ? 0 : cursor.pos;
+}
+
+// Size in bytes of the blob reverb_save_state will write
+size_t reverb_state_bytes(const DattoroReverb *reverb)
+{
+    return write_state(reverb, NULL, 0);
+}
+
+// Save the full state of a reverb (settings, layout, quality, delay line
+// contents, heads, modulation phases, filter memories, resampling filters, a
+// frozen loop and any crossfade in progress) into data, which must hold at
+// least reverb_state_bytes(reverb) bytes. Delay lines are saved at their
+// current length, not their capacity. Returns the number of bytes written, 0 if too small
+size_t reverb_save_state(const DattoroReverb *reverb, void *data, size_t bytes)
+{
+    return write_state(reverb, data, bytes);
+}
+
+static bool get_state(StateCursor *c, DattoroReverb *reverb)
+{
+    DelayLine *delays[REVERB_ALL_DELAYS];
+    uint32_t magic, version;
+    int sample_rate, n_delays, decimation, base_decimation, quality;
+    int crossfade_frames, crossfade_left;
+    bool cached;
+
+    state_get(c, &magic, sizeof(magic));
+    state_get(c, &version, sizeof(version));
+    STATE_FIELD(c, state_get, sample_rate);
+    STATE_FIELD(c, state_get, n_delays);
+    STATE_FIELD(c, state_get, decimation);
+    STATE_FIELD(c, state_get, base_decimation);
+    STATE_FIELD(c, state_get, quality);
+    if (magic != STATE_MAGIC || version != STATE_VERSION || sample_rate != reverb->sample_rate ||
+        n_delays != REVERB_ALL_DELAYS || quality < REVERB_QUALITY_FULL || quality >= REVERB_QUALITY_MAX)
+        return false;
+    reverb->crossfade_left = 0;
+    reverb->quality = quality;
+    if (!reverb_set_decimation(reverb, base_decimation) || reverb->decimation != decimation)
+        return false;
+
+    reverb_delays(reverb, delays);
+    REVERB_STATE_FIELDS(c, state_get, reverb);
+    if (reverb->multirate)
+    {
+        state_get(c, reverb->multirate, sizeof(*reverb->multirate));
+        if (!valid_multirate(reverb->multirate, reverb->decimation))
+            return false;
+    }
+    if (!valid_bool(&reverb->true_stereo) || !valid_bool(&reverb->frozen) || !valid_bool(&reverb->idle) ||
+        !(reverb->hold_target >= 0.0) || !(reverb->hold_level >= 0.0) || reverb->hold_frames < 0)
+        return false;
+    // a cached frozen loop must have the size this reverb would record
+    free(reverb->freeze);
+    reverb->freeze = NULL;
+    STATE_FIELD(c, state_get, cached);
+    if (!valid_bool(&cached) || (cached && reverb->in_place))
+        return false;
+    if (cached)
+    {
+        ReverbFreeze *freeze, header;
+
+        // a loop being released since a change of layout holds the sets of the old one
+        state_get(c, &header, sizeof(header));
+        if (header.n_sets < 2 || header.n_sets > REVERB_MAX_OUTPUTS ||
+            (header.n_sets != reverb->n_tap_sets &&
+             (header.release == 0 || header.recorded != header.loop_frames + header.fade_frames)))
+            return false;
+        freeze = create_freeze(reverb, header.n_sets);
+        reverb->freeze = freeze;
+        if (header.loop_frames != freeze->loop_frames ||
+            header.fade_frames != freeze->fade_frames || header.recorded < 0 ||
+            header.recorded > freeze->loop_frames + freeze->fade_frames || header.position < 0 ||
+            header.position >= freeze->loop_frames || header.release < 0 || header.release > freeze->fade_frames)
+            return false;
+        *freeze = header;
+        state_get(c, freeze->loop, freeze_bytes(freeze) - sizeof(*freeze));
+    }
+    for (int i = 0; i < n_delays; i++)
+    {
+        DelayLine *delay = delays[i];
+        DELAY_STATE_FIELDS(c, state_get, delay);
+        if (!valid_delay(delay))
+            return false;
+        if (delay->n_samples + 1 > delay->max_n_samples)
+        {
+            if (delay->fixed_capacity)
+                return false;
+            delay->max_n_samples = delay->n_samples + 1;
+            delay->samples = (float *)realloc(delay->samples, sizeof(*delay->samples) * delay->max_n_samples);
+        }
+        if (c->check)
+        {
+            state_skip(c, sizeof(*delay->samples) * delay->n_samples);
+            continue;
+        }
+        state_get(c, delay->samples, sizeof(*delay->samples) * delay->n_samples);
+        memset(delay->samples + delay->n_samples, 0,
+               sizeof(*delay->samples) * (delay->max_n_samples - delay->n_samples));
+        delay->used = delay->n_samples;
+    }
+    // the output taps are read from the lines as loaded
+    if (!valid_outputs(reverb))
+        return false;
+    STATE_FIELD(c, state_get, crossfade_frames);
+    STATE_FIELD(c, state_get, crossfade_left);
+    STATE_FIELD(c, state_get, reverb->next_quality);
+    if (crossfade_left < 0 || crossfade_left > crossfade_frames || (crossfade_left > 0 && reverb->in_place) ||
+        reverb->next_quality < REVERB_QUALITY_FULL || reverb->next_quality >= REVERB_QUALITY_MAX ||
+        (reverb->in_place && reverb->next_quality != reverb->quality))
+        return false;
+    if (crossfade_left > 0)
+    {
+        if (!reverb->crossfade)
+            reverb->crossfade = create_reverb(reverb->sample_rate);
+        if (!get_state(c, reverb->crossfade))
+            return false;
+    }
+    reverb->crossfade_frames = crossfade_frames;
+    reverb->crossfade_left = crossfade_left;
+    return !c->overflow;
+}
+
+// Make a reverb the one a state was loaded into: its network, and the
+// network at the old tier of a crossfade in progress
+static void commit_state(DattoroReverb *reverb, const DattoroReverb *loaded)
+{
+    copy_reverb(reverb, loaded);
+    if (loaded->crossfade_left > 0)
+    {
+        if (!reverb->crossfade)
+            reverb->crossfade = create_reverb(reverb->sample_rate);
+        commit_state(reverb->crossfade, loaded->crossfade);
+    }
+    reverb->crossfade_frames = loaded->crossfade_frames;
+    reverb->crossfade_left = loaded->crossfade_left;
+}
+
+// Check a state fits an in-place reverb, by loading it into a copy of the
+// reverb's fields, line headers and resampling filters with the samples
+// passed over, so the reverb is untouched and nothing is allocated
+static bool check_in_place_state(const DattoroReverb *reverb, const void *data, size_t bytes)
+{
+    StateCursor cursor = {(unsigned char *)data, bytes, 0, false, true};
+    DattoroReverb shadow = *reverb;
+    DelayLine lines[REVERB_ALL_DELAYS], *delays[REVERB_ALL_DELAYS];
+    ReverbMultirate multirate;
+
+    reverb_delays(reverb, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+    {
+        lines[i] = *delays[i];
+        delays[i] = &lines[i];
+    }
+    reverb_set_delays(&shadow, delays);
+    if (reverb->multirate)
+    {
+        multirate = *reverb->multirate;
+        shadow.multirate = &multirate;
+    }
+    return get_state(&cursor, &shadow);
+}
+
+// Restore a state written by reverb_save_state, into a reverb with the same
+// sample rate. Delay lines grow if needed; an in-place reverb's cannot, so it
+// only loads states that fit it, at its tank rate, with no frozen loop cached
+// and no crossfade in progress. The blob is checked in full before anything
+// is changed: returns false, leaving the reverb as it was, if it is invalid
+bool reverb_load_state(DattoroReverb *reverb, const void *data, size_t bytes)
+{
+    StateCursor cursor = {(unsigned char *)data, bytes, 0, false, false};
+    DattoroReverb *loaded;
+    bool ok;
+
+    if (reverb->in_place)
+    {
+        // once checked, the load into the reverb itself cannot fail
+        if (!check_in_place_state(reverb, data, bytes))
+            return false;
+        return get_state(&cursor, reverb);
+    }
+    loaded = create_reverb(reverb->sample_rate);
+    ok = get_state(&cursor, loaded);
+    if (ok)
+    {
+        commit_state(reverb, loaded);
+        // a switch still waiting to start needs its memory set aside again
+        reserve_quality_switch(reverb);
+    }
+    destroy_reverb(loaded);
+    return ok;
+}
+
+float apply_diffusion(DelayLine *delay, float x, float diffusion)
+{
+    float y = delay_out(delay);
+    float z = x - y * diffusion;
+    delay_in(delay, z);
+    return y + z * diffusion;
+}
+
+// Predelay, band-limit and diffuse one input (0 left or mixed, 1 right) on
+// its way into the tank
+static float input_step(DattoroReverb *reverb, int input, float x)
+{
+    DelayLine *pre_delay = input ? reverb->pre_delay_r : reverb->pre_delay;
+    float *pre_sample = input ? &reverb->pre_sample_r : &reverb->pre_sample;
+    const int *diffusers = input_diffusers[input];
+
+    // Initial computation
+    delay_in(pre_delay, x);
+    x = delay_out(pre_delay);
+    x = reverb->bandwidth * x + (1 - reverb->bandwidth) * *pre_sample;
+    *pre_sample = x;
+
+    // Sequential part
+
+    // delay lines 142, 107, 379 and 277
+    x = apply_diffusion(reverb->delay_lines[diffusers[0]], x, reverb->input_diffusion_1);
+    x = apply_diffusion(reverb->delay_lines[diffusers[1]], x, reverb->input_diffusion_1);
+    x = apply_diffusion(reverb->delay_lines[diffusers[2]], x, reverb->input_diffusion_2);
+    x = apply_diffusion(reverb->delay_lines[diffusers[3]], x, reverb->input_diffusion_2);
+    return x;
+}
+
+// Frames a frozen tank's level is measured over, and then followed over
+static int freeze_hold_frames(const DattoroReverb *reverb)
+{
+    return (int)ceil(FREEZE_LOOP_TIME * tank_rate(reverb));
+}
+
+// Loop gain of a frozen tank: 1, unless its level has risen by more than
+// FREEZE_HOLD_MARGIN, as the interpolation of the modulated delays slowly
+// pumps it up, when it is pulled back down
+static float frozen_decay(const DattoroReverb *reverb)
+{
+    double excess = reverb->hold_level / reverb->hold_target - FREEZE_HOLD_MARGIN;
+
+    if (reverb->hold_frames < freeze_hold_frames(reverb) || reverb->hold_target <= 0.0 || excess <= 0.0)
+        return 1.0f;
+    return fmax(1.0 - FREEZE_HOLD_RATE * excess, FREEZE_HOLD_MIN_GAIN);
+}
+
+// Measure the level of a frozen tank's loop signals, then follow it
+static void track_frozen_level(DattoroReverb *reverb, float p, float q)
+{
+    double power = (double)p * p + (double)q * q;
+    int frames = freeze_hold_frames(reverb);
+
+    if (reverb->hold_frames < frames)
+    {
+        reverb->hold_target += (power - reverb->hold_target) / ++reverb->hold_frames;
+        reverb->hold_level = reverb->hold_target;
+    }
+    else
+        reverb->hold_level += (power - reverb->hold_level) / frames;
+}
+
+// Run the network on one sample of a stereo signal, up to the output taps
+static void tank_step(DattoroReverb *reverb, float l, float r)
+{
+    float x_l, x_r, y, z, p, q;
+    // frozen, the input section is bypassed and the tank is lossless
+    float decay = reverb->frozen ? frozen_decay(reverb) : reverb->decay;
+
+    // in true stereo each input has its own diffusers, and feeds the loop the
+    // output on its side mostly reads (the left output's taps are mostly on
+    // the Q loop); otherwise their mix feeds both
+    if (reverb->frozen)
+        x_l = x_r = 0.0f;
+    else if (reverb->true_stereo)
+    {
+        x_l = input_step(reverb, 0, l);
+        x_r = input_step(reverb, 1, r);
+    }
+    else
+        x_l = x_r = input_step(reverb, 0, (l + r) / 2.0);
+
+    p = decay * delay_out(reverb->delay_lines[DELAY_3720]) + x_r;
+    q = decay * delay_out(reverb->delay_lines[DELAY_3163]) + x_l;
+
+    // P Loop
+    // delay line 672
+    y = delay_out(reverb->delay_lines[DELAY_672]);
+    z = p - y * reverb->decay_diffusion_1;
+    delay_in(reverb->delay_lines[DELAY_672], z);
+    p = y + z * reverb->decay_diffusion_1;
+
+    // delay/filter 4453
+    delay_in(reverb->delay_lines[DELAY_4453], p);
+    p = delay_out(reverb->delay_lines[DELAY_4453]);
+    if (!reverb->frozen)
+        p = (1 - reverb->damping) * p + reverb->damping * reverb->diffusion_sample_a;
+    reverb->diffusion_sample_a = p;
+
+    p = p * decay;
+
+    // delay line 1800
+    p = apply_diffusion(reverb->delay_lines[DELAY_1800], p, reverb->decay_diffusion_2);
+
+    // delay line 3720
+    delay_in(reverb->delay_lines[DELAY_3720], p);
+
+    // Q loop
+    // delay line 908
+    y = delay_out(reverb->delay_lines[DELAY_908]);
+    z = q - y * reverb->decay_diffusion_1;
+    delay_in(reverb->delay_lines[DELAY_908], z);
+    q = y + z * reverb->decay_diffusion_1;
+
+    // delay/filter 4217
+    delay_in(reverb->delay_lines[DELAY_4217], q);
+    q = delay_out(reverb->delay_lines[DELAY_4217]);
+    if (!reverb->frozen)
+        q = (1 - reverb->damping) * q + reverb->damping * reverb->diffusion_sample_b;
+    reverb->diffusion_sample_b = q;
+
+    q = q * decay;
+
+    // delay line 2656
+    q = apply_diffusion(reverb->delay_lines[DELAY_2656], q, reverb->decay_diffusion_2);
+
+    // delay line 3163
+    delay_in(reverb->delay_lines[DELAY_3163], q);
+
+    if (reverb->frozen)
+        track_frozen_level(reverb, reverb->diffusion_sample_a, reverb->diffusion_sample_b);
+}
+
+// Sum one set of output taps, or only three of them at the reduced quality
+static float read_tap_set(DattoroReverb *reverb, int set)
+{
+    const ReverbOutputTap *taps = reverb->output_taps[set];
+    float y = 0.0f;
+
+    if (reverb->quality >= REVERB_QUALITY_REDUCED_TAPS)
+    {
+        const int *reduced = reduced_taps[set >= 2 ? 2 : set == 1 && reverb->true_stereo ? 3 : set];
+        for (int i = 0; i < REDUCED_TAPS; i++)
+        {
+            const ReverbOutputTap *tap = &taps[reduced[i]];
+            y += tap->sign * REDUCED_TAP_GAIN * tap_delay(reverb->delay_lines[tap->delay], tap->index);
+        }
+        return y;
+    }
+    for (int i = 0; i < REVERB_OUTPUT_TAPS; i++)
+        y += taps[i].gain * 0.6 * tap_delay(reverb->delay_lines[taps[i].delay], taps[i].index);
+    return y;
+}
+
+// Step the tank and read its first n_sets tap sets into sets. A frozen tank
+// with a cached loop is recorded into it, then the loop is played back
+// instead of running the tank
+static void tank_sets(DattoroReverb *reverb, float l, float r, float *sets, int n_sets)
+{
+    ReverbFreeze *freeze = reverb->freeze;
+    float *frame, fade;
+
+    if (!freeze)
+    {
+        tank_step(reverb, l, r);
+        for (int i = 0; i < n_sets; i++)
+            sets[i] = read_tap_set(reverb, i);
+        return;
+    }
+
+    if (freeze->recorded < freeze->loop_frames + freeze->fade_frames)
+    {
+        int position = freeze->recorded % freeze->loop_frames;
+
+        tank_step(reverb, l, r);
+        frame = freeze->loop + position * freeze->n_sets;
+        if (freeze->recorded < freeze->loop_frames)
+        {
+            for (int i = 0; i < freeze->n_sets; i++)
+                frame[i] = read_tap_set(reverb, i);
+        }
+        else
+        {
+            // equal power crossfade from the running tank into the start of
+            // the loop, so the end of the loop runs on into its start
+            fade = (position + 0.5f) / freeze->fade_frames * (float)M_PI_2;
+            for (int i = 0; i < freeze->n_sets; i++)
+                frame[i] = cosf(fade) * read_tap_set(reverb, i) + sinf(fade) * frame[i];
+        }
+        if (++freeze->recorded == freeze->loop_frames + freeze->fade_frames)
+            freeze->position = freeze->fade_frames;
+        memcpy(sets, frame, sizeof(*sets) * n_sets);
+        return;
+    }
+
+    frame = freeze->loop + freeze->position * freeze->n_sets;
+    if (++freeze->position == freeze->loop_frames)
+        freeze->position = 0;
+    if (freeze->release == 0)
+    {
+        memcpy(sets, frame, sizeof(*sets) * n_sets);
+        return;
+    }
+
+    // crossfade from the loop back to the running tank, then drop the loop.
+    // Since a change of layout the loop may hold fewer sets than are read
+    tank_step(reverb, l, r);
+    fade = (freeze->release - 0.5f) / freeze->fade_frames * (float)M_PI_2;
+    for (int i = 0; i < n_sets; i++)
+        sets[i] = (i < freeze->n_sets ? sinf(fade) * frame[i] : 0.0f) + cosf(fade) * read_tap_set(reverb, i);
+    if (--freeze->release == 0)
+    {
+        free(freeze);
+        reverb->freeze = NULL;
+        update_freeze(reverb);
+    }
+}
+
+// Take a stereo signal and compute the Dattoro reverb of it
+void compute_reverb(DattoroReverb *reverb, float l, float r, float *out_l, float *out_r)
+{
+    float sets[REVERB_MAX_OUTPUTS];
+
+    reverb->idle = false;
+    tank_sets(reverb, l, r, sets, 2);
+    *out_l = sets[0];
+    *out_r = sets[1];
+}
+
+// Take a stereo signal and compute every output of the reverb's layout
+static void compute_outputs(DattoroReverb *reverb, float l, float r, float *out)
+{
+    float sets[REVERB_MAX_OUTPUTS];
+
+    tank_sets(reverb, l, r, sets, reverb->n_tap_sets);
+    for (int c = 0; c < reverb->n_outputs; c++)
+    {
+        if (reverb->layout == REVERB_LAYOUT_AMBISONIC)
+        {
+            out[c] = 0.0f;
+            for (int i = 0; i < reverb->n_tap_sets; i++)
+                out[c] += reverb->output_matrix[c][i] * sets[i];
+        }
+        else
+            out[c] = reverb->output_source[c] < 0 ? 0.0f : sets[reverb->output_source[c]];
+    }
+}
+
+// Add a sample to a half-band filter's history; returns the history window,
+// with the new sample at [0] and older ones at negative indices
+static const float *halfband_push(HalfBand *hb, float x)
+{
+    const float *window = hb->history + hb->pos + HALFBAND_HISTORY;
+
+    hb->history[hb->pos] = x;
+    hb->history[hb->pos + HALFBAND_HISTORY] = x;
+    hb->pos = (hb->pos + 1) & (HALFBAND_HISTORY - 1);
+    return window;
+}
+
+// Decimator output for the window ending at the second sample of a pair
+static float halfband_decimate(const float *w)
+{
+    float y = 0.5f * w[-HALFBAND_CENTRE];
+
+    for (int j = 0; j < HALFBAND_COEFFS; j++)
+        y += halfband_coeffs[j] * (w[-(HALFBAND_CENTRE - 1 - 2 * j)] + w[-(HALFBAND_CENTRE + 1 + 2 * j)]);
+    return y;
+}
+
+// Interpolate one sample into two: the even phase is the filter on the
+// history, the odd phase only the delayed centre tap
+static void halfband_interpolate(HalfBand *hb, float x, float *y)
+{
+    const float *w = halfband_push(hb, x);
+    float sum = 0.0f;
+
+    for (int j = 0; j < HALFBAND_COEFFS; j++)
+        sum += halfband_coeffs[j] * (w[-(HALFBAND_COEFFS - 1 - j)] + w[-(HALFBAND_COEFFS + j)]);
+    y[0] = 2.0f * sum;
+    y[1] = w[-(HALFBAND_COEFFS - 1)];
+}
+
+// One full-rate frame of a decimated reverb, with the stereo input l, r,
+// giving the stereo outputs, or with layout set every output of the layout.
+// The tank runs once every decimation frames; its interpolated output is
+// played out over the following ones
+static void multirate_reverb(DattoroReverb *reverb, float l, float r, float *out, bool layout)
+{
+    ReverbMultirate *mr = reverb->multirate;
+    int n_outputs = layout ? reverb->n_outputs : 2;
+    // without true stereo only the mix of the inputs is needed, and a frozen
+    // tank takes none, so its decimators rest (unfreezing clears them)
+    int n_inputs = reverb->frozen ? 0 : reverb->true_stereo ? 2 : 1;
+    const float *w[2];
+    float x[2] = {l, r}, y[REVERB_MAX_OUTPUTS], mid[2];
+
+    for (int c = 0; c < n_outputs; c++)
+        out[c] = mr->wet[c][mr->phase];
+
+    if (n_inputs == 1)
+        x[0] = (l + r) / 2.0;
+    // each stage only filters on every second sample
+    for (int i = 0; i < n_inputs; i++)
+        w[i] = halfband_push(&mr->decimator[i][0], x[i]);
+    if (++mr->phase & 1)
+        return;
+    for (int i = 0; i < n_inputs; i++)
+        x[i] = halfband_decimate(w[i]);
+    if (reverb->decimation == 4)
+    {
+        for (int i = 0; i < n_inputs; i++)
+            w[i] = halfband_push(&mr->decimator[i][1], x[i]);
+        if (mr->phase < 4)
+            return;
+        for (int i = 0; i < n_inputs; i++)
+            x[i] = halfband_decimate(w[i]);
+    }
+    mr->phase = 0;
+    if (n_inputs == 1)
+        x[1] = x[0];
+
+    if (layout)
+        compute_outputs(reverb, x[0], x[1], y);
+    else
+        compute_reverb(reverb, x[0], x[1], &y[0], &y[1]);
+    for (int c = 0; c < n_outputs; c++)
+    {
+        if (reverb->decimation == 2)
+        {
+            halfband_interpolate(&mr->interpolator[c][0], y[c], mr->wet[c]);
+            continue;
+        }
+        halfband_interpolate(&mr->interpolator[c][1], y[c], mid);
+        halfband_interpolate(&mr->interpolator[c][0], mid[0], mr->wet[c]);
+        halfband_interpolate(&mr->interpolator[c][0], mid[1], mr->wet[c] + 2);
+    }
+}
+
+// One frame of the wet output, from the network at the full or the tank
+// rate: the stereo outputs, or with layout set every output of the layout
+static void reverb_frame(DattoroReverb *reverb, float l, float r, float *out, bool layout)
+{
+    if (reverb->multirate)
+        multirate_reverb(reverb, l, r, out, layout);
+    else if (layout)
+        compute_outputs(reverb, l, r, out);
+    else
+        compute_reverb(reverb, l, r, &out[0], &out[1]);
+}
+
+// One frame of the wet output while crossfading from the previous quality
+static void crossfade_frame(DattoroReverb *reverb, float l, float r, float *out, bool layout)
+{
+    int n_outputs = layout ? reverb->n_outputs : 2;
+    float old[REVERB_MAX_OUTPUTS], fade;
+
+    reverb_frame(reverb->crossfade, l, r, old, layout);
+    reverb_frame(reverb, l, r, out, layout);
+    fade = (float)reverb->crossfade_left-- / reverb->crossfade_frames;
+    for (int c = 0; c < n_outputs; c++)
+        out[c] += fade * (old[c] - out[c]);
+}
+
+// Set aside, on the control thread, the memory a waiting quality switch
+// will need, so that a buffer call starting it only copies and resamples:
+// room in the crossfade network's delay lines for a copy of this network,
+// room in this network's lines for their lengths at the new tank rate, and
+// resampling filters for either if they are to start decimating. Called
+// again whenever a change to the settings might need more
+static void reserve_quality_switch(DattoroReverb *reverb)
+{
+    DattoroReverb *old = reverb->crossfade;
+    DelayLine *delays[REVERB_ALL_DELAYS], *old_delays[REVERB_ALL_DELAYS];
+    int decimation = quality_decimation(reverb->base_decimation, reverb->next_quality);
+    double rate = (double)reverb->sample_rate / decimation;
+    double sr_ratio = reverb->params[REVERB_SIZE] * rate / 29761.0;
+
+    if (reverb->in_place || !old || reverb->next_quality == reverb->quality)
+        return;
+    reverb_delays(reverb, delays);
+    reverb_delays(old, old_delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        grow_delay(old_delays[i], delays[i]->n_samples / 2);
+    if (reverb->multirate && !old->multirate && !old->spare_multirate)
+        old->spare_multirate = (ReverbMultirate *)malloc(sizeof(*old->spare_multirate));
+
+    // the lengths set_reverb_param will give the lines at the new rate; the
+    // right input's are only sized in true stereo
+    grow_delay(reverb->pre_delay, reverb->params[REVERB_PREDELAY] * rate);
+    if (reverb->true_stereo)
+        grow_delay(reverb->pre_delay_r, reverb->params[REVERB_PREDELAY] * rate);
+    for (int i = 0; i < (reverb->true_stereo ? DELAY_MAX : DELAY_142_R); i++)
+        grow_delay(reverb->delay_lines[i], delay_times[i] * sr_ratio);
+    if (decimation > 1 && !reverb->multirate && !reverb->spare_multirate)
+        reverb->spare_multirate = (ReverbMultirate *)malloc(sizeof(*reverb->spare_multirate));
+}
+
+// Start crossfading from the current quality tier to another. The network
+// for the old tier is made on the first switch; after that this allocates
+// nothing once reserve_quality_switch has made room, except for a cached
+// frozen loop, which is copied and resampled as it is
+static void start_quality_crossfade(DattoroReverb *reverb, int quality)
+{
+    // the old tier carries on in the copy, from exactly the same state
+    if (!reverb->crossfade)
+        reverb->crossfade = create_reverb(reverb->sample_rate);
+    copy_reverb(reverb->crossfade, reverb);
+    reverb->crossfade_frames = (int)ceil(QUALITY_CROSSFADE_TIME * reverb->sample_rate);
+    reverb->crossfade_left = reverb->crossfade_frames;
+
+    reverb->quality = quality;
+    reverb->next_quality = quality;
+    set_reverb_param(reverb, REVERB_MODULATION, reverb->params[REVERB_MODULATION]);
+    // the copy also holds the network as it was, to resample from
+    update_decimation(reverb, reverb->crossfade);
+}
+
+// Switch to another quality tier with no crossfade
+static void switch_quality(DattoroReverb *reverb, int quality)
+{
+    reverb->quality = quality;
+    reverb->next_quality = quality;
+    set_reverb_param(reverb, REVERB_MODULATION, reverb->params[REVERB_MODULATION]);
+    update_decimation(reverb, NULL);
+}
+
+// Start the switch asked for during the last crossfade, once it has ended.
+// Called from the buffer functions, so relies on reserve_quality_switch
+static void start_next_quality(DattoroReverb *reverb)
+{
+    if (reverb->crossfade_left == 0 && reverb->next_quality != reverb->quality)
+        start_quality_crossfade(reverb, reverb->next_quality);
+}
+
+// Switch to a cheaper or better quality tier, crossfading from the current
+// one over QUALITY_CROSSFADE_TIME, during which both networks run.
+//  - REVERB_QUALITY_NO_MODULATION holds the modulated tank delays where they are
+//  - REVERB_QUALITY_REDUCED_TAPS also reads three output taps per side, not seven
+//  - REVERB_QUALITY_HALF_RATE also halves the tank rate (see reverb_set_decimation)
+// A change during a crossfade waits for it to end, so the output never jumps,
+// and is started by the first buffer call after that; only the last tier asked
+// for is kept. A reverb that has made no output since it was created or
+// cleared has nothing to crossfade from, so switches at once, as does an
+// in-place reverb, which has no room for the second network, and only
+// switches between tiers at its tank rate.
+// Not real-time safe: the first crossfade allocates the second network, a
+// switch to or from REVERB_QUALITY_HALF_RATE resizes the delay lines, and a
+// waiting switch sets aside the memory it will need. The buffer call that
+// starts a waiting switch then only copies and resamples the network, into
+// that memory (a cached frozen loop is still allocated as it is copied).
+// Returns false, changing nothing, for an unknown tier
+bool reverb_set_quality(DattoroReverb *reverb, int quality)
+{
+    if (quality < REVERB_QUALITY_FULL || quality >= REVERB_QUALITY_MAX)
+        return false;
+    if (reverb->crossfade_left > 0)
+    {
+        reverb->next_quality = quality;
+        reserve_quality_switch(reverb);
+        return true;
+    }
+    if (quality == reverb->quality)
+    {
+        // drop any switch still waiting to start
+        reverb->next_quality = quality;
+        return true;
+    }
+    if (reverb->in_place && quality_decimation(reverb->base_decimation, quality) != reverb->decimation)
+        return false;
+    if (reverb->in_place || reverb->idle)
+        switch_quality(reverb, quality);
+    else
+        start_quality_crossfade(reverb, quality);
+    return true;
+}
+
+// Monotonic time in seconds, for the load meter
+static double load_meter_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Record a buffer call of n_frames that started at time start, after
+// clearing the statistics if a reset has been asked for
+static void load_meter_update(ReverbLoadMeter *meter, double start, int n_frames, int sample_rate)
+{
+    double duration, alpha;
+    float load, average, peak;
+
+    if (n_frames <= 0)
+        return;
+    if (atomic_exchange_explicit(&meter->reset, false, memory_order_acquire))
+    {
+        atomic_store_explicit(&meter->current, 0.0f, memory_order_relaxed);
+        atomic_store_explicit(&meter->average, 0.0f, memory_order_relaxed);
+        atomic_store_explicit(&meter->peak, 0.0f, memory_order_relaxed);
+        atomic_store_explicit(&meter->overruns, 0, memory_order_relaxed);
+        atomic_store_explicit(&meter->calls, 0, memory_order_relaxed);
+    }
+    duration = (double)n_frames / sample_rate;
+    load = (load_meter_now() - start) / duration;
+
+    // exponential average, weighted by the duration of each buffer
+    alpha = duration / (duration + LOAD_AVERAGE_TIME);
+    average = atomic_load_explicit(&meter->average, memory_order_relaxed);
+    if (atomic_load_explicit(&meter->calls, memory_order_relaxed) == 0)
+        average = load;
+    else
+        average += alpha * (load - average);
+
+    atomic_store_explicit(&meter->current, load, memory_order_relaxed);
+    atomic_store_explicit(&meter->average, average, memory_order_relaxed);
+    peak = atomic_load_explicit(&meter->peak, memory_order_relaxed);
+    if (load > peak)
+        atomic_store_explicit(&meter->peak, load, memory_order_relaxed);
+    if (load > 1.0f)
+        atomic_fetch_add_explicit(&meter->overruns, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&meter->calls, 1, memory_order_release);
+}
+
+// True if the buffer functions are to time themselves
+static bool load_metered(const DattoroReverb *reverb)
+{
+    return atomic_load_explicit(&reverb->load_meter->enabled, memory_order_relaxed);
+}
+
+// Turn DSP load metering of the buffer functions on or off. Turning it on
+// clears the statistics. The meter itself is never freed, so this is safe
+// from any thread, even while the audio thread is inside a buffer call
+void reverb_enable_load_meter(DattoroReverb *reverb, bool enable)
+{
+    ReverbLoadMeter *meter = reverb->load_meter;
+
+    if (enable && !atomic_load_explicit(&meter->enabled, memory_order_relaxed))
+        atomic_store_explicit(&meter->reset, true, memory_order_release);
+    atomic_store_explicit(&meter->enabled, enable, memory_order_release);
+}
+
+// Read the load statistics; safe to call from any thread
+// All zero if the meter is not enabled, or a reset has not been carried out yet
+void reverb_get_load(const DattoroReverb *reverb, ReverbLoad *load)
+{
+    ReverbLoadMeter *meter = reverb->load_meter;
+
+    memset(load, 0, sizeof(*load));
+    if (!atomic_load_explicit(&meter->enabled, memory_order_acquire) ||
+        atomic_load_explicit(&meter->reset, memory_order_acquire))
+        return;
+    load->calls = atomic_load_explicit(&meter->calls, memory_order_acquire);
+    load->current = atomic_load_explicit(&meter->current, memory_order_relaxed);
+    load->average = atomic_load_explicit(&meter->average, memory_order_relaxed);
+    load->peak = atomic_load_explicit(&meter->peak, memory_order_relaxed);
+    load->overruns = atomic_load_explicit(&meter->overruns, memory_order_relaxed);
+}
+
+// Clear the load statistics; safe to call from any thread. Only the audio
+// thread writes them, so this asks it to clear them before its next update
+void reverb_reset_load(DattoroReverb *reverb)
+{
+    atomic_store_explicit(&reverb->load_meter->reset, true, memory_order_release);
+}
+
+void mono_reverb_buffer(DattoroReverb *reverb, float *buffer, int bufferLen)
+{
+    int i;
+    float out[2];
+    bool metered = load_metered(reverb);
+    double start = metered ? load_meter_now() : 0.0;
+
+    start_next_quality(reverb);
+    reverb->idle = false;
+    for (i = 0; i < bufferLen; i++)
+    {
+        if (reverb->crossfade_left > 0)
+            crossfade_frame(reverb, buffer[i], buffer[i], out, false);
+        else
+            reverb_frame(reverb, buffer[i], buffer[i], out, false);
+        buffer[i] = reverb->dry_gain * buffer[i] + reverb->wet_gain * out[0];
+    }
+    if (metered)
+        load_meter_update(reverb->load_meter, start, bufferLen, reverb->sample_rate);
+}
+
+// assumes interleaved stereo
+void stereo_reverb_buffer(DattoroReverb *reverb, float *buffer, int bufferLen)
+{
+    int i;
+    float out[2];
+    bool metered = load_metered(reverb);
+    double start = metered ? load_meter_now() : 0.0;
+
+    start_next_quality(reverb);
+    reverb->idle = false;
+    for (i = 0; i < bufferLen; i += 2)
+    {
+        if (reverb->crossfade_left > 0)
+            crossfade_frame(reverb, buffer[i], buffer[i + 1], out, false);
+        else
+            reverb_frame(reverb, buffer[i], buffer[i + 1], out, false);
+        buffer[i] = reverb->dry_gain * buffer[i] + reverb->wet_gain * out[0];
+        buffer[i + 1] = reverb->dry_gain * buffer[i + 1] + reverb->wet_gain * out[1];
+    }
+    if (metered)
+        load_meter_update(reverb->load_meter, start, bufferLen / 2, reverb->sample_rate);
+}
+
+// Render interleaved stereo input into every output of the reverb's layout,
+// interleaved (reverb->n_outputs channels per frame), at the wet gain and
+// with no dry signal
+void multi_reverb_buffer(DattoroReverb *reverb, const float *input, float *output, int n_frames)
+{
+    bool metered = load_metered(reverb);
+    double start = metered ? load_meter_now() : 0.0;
+    int n_outputs = reverb->n_outputs;
+
+    start_next_quality(reverb);
+    reverb->idle = false;
+    for (int i = 0; i < n_frames; i++)
     {
-        compute_reverb(reverb, buffer[i], buffer[i + 1], &l, &r);
-        buffer[i] = reverb->dry_gain * buffer[i] + reverb->wet_gain * l;
-        buffer[i + 1] = reverb->dry_gain * buffer[i + 1] + reverb->wet_gain * r;
+        float *out = output + i * n_outputs;
+        if (reverb->crossfade_left > 0)
+            crossfade_frame(reverb, input[2 * i], input[2 * i + 1], out, true);
+        else
+            reverb_frame(reverb, input[2 * i], input[2 * i + 1], out, true);
+        for (int c = 0; c < n_outputs; c++)
+            out[c] *= reverb->wet_gain;
     }
+    if (metered)
+        load_meter_update(reverb->load_meter, start, n_frames, reverb->sample_rate);
 }
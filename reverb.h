@@ -13,6 +13,7 @@
 #ifndef __REVERB_H__
 #define __REVERB_H__
 #include <stdbool.h>
+#include <stddef.h>
 
 
 #define INIT_DELAY_MAX 256
@@ -21,12 +22,25 @@
 #define MODDELAY_INTERPOLATION_LINEAR 1
 #define MODDELAY_INTERPOLATION_ALLPASS 2
 
+// output channels of the largest layout, and taps read for each
+#define REVERB_MAX_OUTPUTS 8
+#define REVERB_OUTPUT_TAPS 7
+// delay lines of the network, not counting the predelays, and of the
+// whole reverb, counting both
+#define REVERB_DELAY_LINES 16
+#define REVERB_ALL_DELAYS (REVERB_DELAY_LINES + 2)
+
 
 typedef struct DelayLine
 {
     float *samples;
     int n_samples;
     int max_n_samples;
+    // samples belongs to an in-place reverb's memory, so the line never grows
+    int fixed_capacity;
+    // the longest n_samples since the line was cleared: only samples up to
+    // and including this one can hold signal
+    int used;
     int read_offset;
     int read_head;
     int write_head;
@@ -56,14 +70,65 @@ float delay_out(DelayLine *delay);
 void set_delay(DelayLine *delay, float length);
 float tap_delay(DelayLine *delay, int index);
 
+enum reverb_params
+{
+    REVERB_PREDELAY,
+    REVERB_BANDWIDTH,
+    REVERB_DAMPING,
+    REVERB_DECAY,
+    REVERB_DIFFUSION_1,
+    REVERB_DIFFUSION_2,
+    REVERB_INPUT_DIFFUSION_1,
+    REVERB_INPUT_DIFFUSION_2,
+    REVERB_MODULATION,
+    REVERB_SIZE,
+    REVERB_WET,
+    REVERB_DRY,
+    REVERB_MAX_PARAMS
+};
+
+/** @struct ReverbOutputTap A tap on a tank delay line: the line, the nominal
+    position in samples, the position scaled to the tank rate, the sign, and
+    the sign weighted toward the loop on the tap's side in true stereo */
+typedef struct ReverbOutputTap
+{
+    int delay;
+    int position;
+    int index;
+    float sign;
+    float gain;
+} ReverbOutputTap;
+
+// Output layouts, with their channel order
+enum reverb_layout
+{
+    REVERB_LAYOUT_STEREO,     // L R
+    REVERB_LAYOUT_5_1,        // L R C LFE Ls Rs
+    REVERB_LAYOUT_7_1,        // L R C LFE Lb Rb Ls Rs
+    REVERB_LAYOUT_AMBISONIC,  // first order ambiX: W Y Z X (ACN order, SN3D)
+    REVERB_LAYOUT_MAX
+};
+
+// Quality tiers, cheapest last; each includes the savings of those before it
+enum reverb_quality
+{
+    REVERB_QUALITY_FULL,
+    REVERB_QUALITY_NO_MODULATION,
+    REVERB_QUALITY_REDUCED_TAPS,
+    REVERB_QUALITY_HALF_RATE,
+    REVERB_QUALITY_MAX
+};
+
 /** @struct DattoroReverb A reverb structure, consisting of a predelay delayline and
     twelve delaylines which form a Dattoro reverb network, two of
     which are modulating, and a set of parameters giving the feedback
-    for the various elements of the reverb network */
+    for the various elements of the reverb network. In true stereo, the right
+    input has its own predelay and four input diffusers, the last delaylines */
 typedef struct DattoroReverb
 {
 
     DelayLine *pre_delay;
+    DelayLine *pre_delay_r;
     float bandwidth;
     float damping;
     float decay;
@@ -74,39 +139,131 @@ typedef struct DattoroReverb
 
     float max_excursion_1;
     float max_excursion_2;
-    DelayLine *delay_lines[12];
+    DelayLine *delay_lines[REVERB_DELAY_LINES];
 
     float pre_sample;
+    float pre_sample_r;
     float diffusion_sample_a;
     float diffusion_sample_b;
     float wet_gain;
     float dry_gain;
     int sample_rate;
+
+    // left input into the Q loop and right into the P loop, rather than
+    // their mix into both
+    bool true_stereo;
+
+    // a frozen tank holds its sound: no input, no damping and no decay.
+    // Without modulation its output is cached as a loop, NULL otherwise
+    bool frozen;
+    struct ReverbFreeze *freeze;
+    // the mean power of a frozen tank's loop signals over its first
+    // hold_frames, which it is held to, and their current power
+    double hold_target;
+    double hold_level;
+    int hold_frames;
+
+    // output layout: n_outputs channels made from n_tap_sets sets of taps,
+    // either one set each (output_source, -1 for silence), or for ambisonics
+    // mixed by output_matrix. The first two sets are the stereo outputs
+    int layout;
+    int n_outputs;
+    int n_tap_sets;
+    ReverbOutputTap output_taps[REVERB_MAX_OUTPUTS][REVERB_OUTPUT_TAPS];
+    int output_source[REVERB_MAX_OUTPUTS];
+    float output_matrix[REVERB_MAX_OUTPUTS][REVERB_MAX_OUTPUTS];
+
+    // the tank runs at sample_rate / decimation (1, 2 or 4): base_decimation,
+    // as set by reverb_set_decimation, doubled at REVERB_QUALITY_HALF_RATE
+    int decimation;
+    int base_decimation;
+    // half-band resampling filters, NULL unless decimating
+    struct ReverbMultirate *multirate;
+    // filters set aside, by a change of rate or reserve_quality_switch, so
+    // that a quality switch started from a buffer call need not allocate
+    struct ReverbMultirate *spare_multirate;
+    // the values last given to set_reverb_param, to reapply if the tank rate changes
+    double params[REVERB_MAX_PARAMS];
+
+    // quality tier, and a copy of the network at the previous tier while
+    // crossfading from it (for crossfade_left more frames). next_quality is
+    // the tier to switch to once the crossfade ends, if it differs
+    int quality;
+    int next_quality;
+    struct DattoroReverb *crossfade;
+    int crossfade_frames;
+    int crossfade_left;
+    // true from creation or reverb_clear until the first frame rendered:
+    // there is nothing to crossfade from, so a quality switch is immediate
+    bool idle;
+
+    // DSP load meter, kept for the life of the reverb and gated by a flag in it
+    struct ReverbLoadMeter *load_meter;
+
+    // laid out in caller memory by reverb_init_in_place, so never allocates
+    bool in_place;
 } DattoroReverb;
 
-enum reverb_params
+/** @struct ReverbConfig What a reverb laid out in caller memory is sized for.
+    Delay lines have room for REVERB_SIZE up to max_size and REVERB_PREDELAY
+    up to max_predelay seconds, with the tank rate fixed by decimation (1, 2
+    or 4) and quality */
+typedef struct ReverbConfig
 {
-    REVERB_PREDELAY,
-    REVERB_BANDWIDTH,
-    REVERB_DAMPING,
-    REVERB_DECAY,
-    REVERB_DIFFUSION_1,
-    REVERB_DIFFUSION_2,
-    REVERB_INPUT_DIFFUSION_1,
-    REVERB_INPUT_DIFFUSION_2,
-    REVERB_MODULATION,
-    REVERB_SIZE,
-    REVERB_WET,
-    REVERB_DRY,
-    REVERB_MAX_PARAMS
-};
+    int sample_rate;
+    double max_size;
+    double max_predelay;
+    int decimation;
+    int quality;
+} ReverbConfig;
+
+/** @struct ReverbLoad A snapshot of the DSP load of a reverb instance.
+    Loads are the processing time of a buffer call as a fraction of the
+    real-time duration of that buffer, so 1.0 means the deadline was just met. */
+typedef struct ReverbLoad
+{
+    float current;
+    float average;
+    float peak;
+    unsigned long overruns;
+    unsigned long calls;
+} ReverbLoad;
 
 DattoroReverb *create_reverb(int sample_rate);
 void set_reverb_param(DattoroReverb *reverb, int param, double value);
 void destroy_reverb(DattoroReverb *reverb);
+DattoroReverb *reverb_clone(const DattoroReverb *reverb);
 void set_default_reverb(DattoroReverb *reverb);
 void compute_reverb(DattoroReverb *reverb, float l, float r, float *out_l, float *out_r);
 void mono_reverb_buffer(DattoroReverb *reverb, float *buffer, int n_samples);
 void stereo_reverb_buffer(DattoroReverb *reverb, float *buffer, int n_samples);
+bool reverb_set_decimation(DattoroReverb *reverb, int decimation);
+bool reverb_set_quality(DattoroReverb *reverb, int quality);
+bool reverb_set_layout(DattoroReverb *reverb, int layout);
+void reverb_set_true_stereo(DattoroReverb *reverb, bool true_stereo);
+void reverb_set_freeze(DattoroReverb *reverb, bool freeze);
+void reverb_delays(const DattoroReverb *reverb, DelayLine **delays);
+void reverb_set_delays(DattoroReverb *reverb, DelayLine *const *delays);
+void multi_reverb_buffer(DattoroReverb *reverb, const float *input, float *output, int n_frames);
+
+bool reverb_is_time_invariant(const DattoroReverb *reverb);
+double reverb_tail_seconds(const DattoroReverb *reverb, double level_db);
+void reverb_impulse_response(const DattoroReverb *reverb, float *ir_l, float *ir_r, int n_frames);
+
+void reverb_clear(DattoroReverb *reverb);
+void reverb_reset(DattoroReverb *reverb);
+void reverb_skip_modulation(DattoroReverb *reverb, long n_frames);
+size_t reverb_state_bytes(const DattoroReverb *reverb);
+size_t reverb_save_state(const DattoroReverb *reverb, void *data, size_t bytes);
+bool reverb_load_state(DattoroReverb *reverb, const void *data, size_t bytes);
+
+size_t reverb_memory_bytes(int sample_rate, double max_size, double max_predelay);
+size_t reverb_instance_bytes(const DattoroReverb *reverb);
+size_t reverb_required_bytes(const ReverbConfig *config);
+DattoroReverb *reverb_init_in_place(void *mem, size_t bytes, const ReverbConfig *config);
+
+void reverb_enable_load_meter(DattoroReverb *reverb, bool enable);
+void reverb_get_load(const DattoroReverb *reverb, ReverbLoad *load);
+void reverb_reset_load(DattoroReverb *reverb);
 
 #endif
\ No newline at end of file
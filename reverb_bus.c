@@ -0,0 +1,169 @@
+/**
+    @file reverb_bus.c
+    @brief A send bus for the Dattoro reverb.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+#include "reverb_bus.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Create a bus of n_sources sends into a new reverb with default settings,
+// rendered in blocks of up to max_frames. Sends start off (no gain, no predelay)
+ReverbBus *create_reverb_bus(int sample_rate, int n_sources, int max_frames)
+{
+    ReverbBus *bus = (ReverbBus *)malloc(sizeof(*bus));
+
+    bus->reverb = create_reverb(sample_rate);
+    bus->n_sources = n_sources;
+    bus->sends = (ReverbSend *)calloc(n_sources, sizeof(*bus->sends));
+    bus->max_frames = max_frames;
+    bus->input = (float *)calloc(max_frames * 2, sizeof(*bus->input));
+    return bus;
+}
+
+void destroy_reverb_bus(ReverbBus *bus)
+{
+    for (int i = 0; i < bus->n_sources; i++)
+        free(bus->sends[i].ring);
+    free(bus->sends);
+    free(bus->input);
+    destroy_reverb(bus->reverb);
+    free(bus);
+}
+
+// Set the send gain (in dB, -INFINITY for off) and predelay (in seconds) of a
+// source. The gain ramps to its new value over the next block sent. The
+// predelay changes at once, and a predelay line that has to grow is cleared
+void reverb_bus_set_send(ReverbBus *bus, int source, double gain_db, double predelay)
+{
+    ReverbSend *send = &bus->sends[source];
+    int frames = (int)lround(fmax(predelay, 0.0) * bus->reverb->sample_rate);
+
+    send->target_gain = pow(10.0, gain_db / 20.0);
+    if (frames >= send->capacity)
+    {
+        int capacity = 1;
+        while (capacity <= frames)
+            capacity *= 2;
+        free(send->ring);
+        send->ring = (float *)calloc(capacity * 2, sizeof(*send->ring));
+        send->capacity = capacity;
+        send->position = 0;
+        send->pending = 0;
+    }
+    send->predelay = frames;
+}
+
+// Add n_frames of a source, with the given stride between frames (1 mono,
+// 2 interleaved stereo), through its gain and predelay into the bus input
+static void send_frames(ReverbBus *bus, ReverbSend *send, const float *buffer, int n_frames, int stride)
+{
+    float *input = bus->input;
+    float gain = send->gain, step;
+    int mask = send->capacity - 1;
+
+    if (n_frames > bus->max_frames)
+        n_frames = bus->max_frames;
+    // a silent send only has to empty its predelay line, which rendering does
+    if (gain == 0.0f && send->target_gain == 0.0f)
+        return;
+    step = (send->target_gain - gain) / n_frames;
+
+    for (int i = 0; i < n_frames; i++)
+    {
+        const float *frame = buffer + i * stride;
+        float l, r;
+
+        gain += step;
+        l = gain * frame[0];
+        r = gain * frame[stride - 1];
+        if (send->predelay > 0)
+        {
+            int read = (send->position - send->predelay) & mask;
+            send->ring[2 * send->position] = l;
+            send->ring[2 * send->position + 1] = r;
+            l = send->ring[2 * read];
+            r = send->ring[2 * read + 1];
+            send->position = (send->position + 1) & mask;
+        }
+        input[2 * i] += l;
+        input[2 * i + 1] += r;
+    }
+    send->gain = send->target_gain;
+    send->pending = send->predelay;
+    send->sent = true;
+}
+
+// Send a block of a mono source to the bus. Every source sent in a block,
+// and the render that ends it, must have the same number of frames
+void reverb_bus_send_mono(ReverbBus *bus, int source, const float *buffer, int n_samples)
+{
+    send_frames(bus, &bus->sends[source], buffer, n_samples, 1);
+}
+
+// Send a block of an interleaved stereo source to the bus
+void reverb_bus_send_stereo(ReverbBus *bus, int source, const float *buffer, int n_samples)
+{
+    send_frames(bus, &bus->sends[source], buffer, n_samples / 2, 2);
+}
+
+// Render the block of sends through the shared reverb into buffer, as
+// interleaved stereo wet signal (at the reverb's REVERB_WET gain, with no dry
+// signal), and start a new block. Sources not sent this block have what is
+// left in their predelay lines played out
+void reverb_bus_render(ReverbBus *bus, float *buffer, int n_samples)
+{
+    DattoroReverb *reverb = bus->reverb;
+    int n_frames = n_samples / 2;
+    float dry_gain = reverb->dry_gain;
+
+    if (n_frames > bus->max_frames)
+        n_frames = bus->max_frames;
+    for (int s = 0; s < bus->n_sources; s++)
+    {
+        ReverbSend *send = &bus->sends[s];
+        int mask = send->capacity - 1;
+
+        if (send->sent)
+        {
+            send->sent = false;
+            continue;
+        }
+        for (int i = 0; i < n_frames && send->pending > 0; i++, send->pending--)
+        {
+            int read = (send->position - send->predelay) & mask;
+            bus->input[2 * i] += send->ring[2 * read];
+            bus->input[2 * i + 1] += send->ring[2 * read + 1];
+            send->ring[2 * send->position] = 0.0f;
+            send->ring[2 * send->position + 1] = 0.0f;
+            send->position = (send->position + 1) & mask;
+        }
+    }
+
+    memcpy(buffer, bus->input, sizeof(*buffer) * 2 * n_frames);
+    memset(bus->input, 0, sizeof(*bus->input) * 2 * n_frames);
+    reverb->dry_gain = 0.0;
+    stereo_reverb_buffer(reverb, buffer, 2 * n_frames);
+    reverb->dry_gain = dry_gain;
+}
+
+// Silence the bus: the reverb, the predelay lines and any block being sent
+void reverb_bus_clear(ReverbBus *bus)
+{
+    for (int s = 0; s < bus->n_sources; s++)
+    {
+        ReverbSend *send = &bus->sends[s];
+        if (send->ring)
+            memset(send->ring, 0, sizeof(*send->ring) * 2 * send->capacity);
+        send->pending = 0;
+        send->sent = false;
+    }
+    memset(bus->input, 0, sizeof(*bus->input) * 2 * bus->max_frames);
+    reverb_clear(bus->reverb);
+}
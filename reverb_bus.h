@@ -0,0 +1,54 @@
+/**
+    @file reverb_bus.h
+    @brief A send bus for the Dattoro reverb: many sources, each with its own
+    send gain and predelay, summed into one shared reverb that is rendered once
+    per block, so a room shared by many voices costs one network.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+
+#ifndef __REVERB_BUS_H__
+#define __REVERB_BUS_H__
+#include "reverb.h"
+#include <stdbool.h>
+
+/** @struct ReverbSend One source's send into a bus: a gain, ramped to its
+    target over each block so changes do not click, and a predelay line */
+typedef struct ReverbSend
+{
+    float gain;
+    float target_gain;
+    int predelay;
+    // interleaved stereo history, capacity frames (a power of two)
+    float *ring;
+    int capacity;
+    int position;
+    // frames of sent signal still in the predelay line
+    int pending;
+    bool sent;
+} ReverbSend;
+
+/** @struct ReverbBus A shared reverb and the sends into it. The sends of a
+    block are summed into input, which the reverb renders once */
+typedef struct ReverbBus
+{
+    DattoroReverb *reverb;
+    int n_sources;
+    ReverbSend *sends;
+    int max_frames;
+    float *input;
+} ReverbBus;
+
+ReverbBus *create_reverb_bus(int sample_rate, int n_sources, int max_frames);
+void destroy_reverb_bus(ReverbBus *bus);
+void reverb_bus_set_send(ReverbBus *bus, int source, double gain_db, double predelay);
+void reverb_bus_send_mono(ReverbBus *bus, int source, const float *buffer, int n_samples);
+void reverb_bus_send_stereo(ReverbBus *bus, int source, const float *buffer, int n_samples);
+void reverb_bus_render(ReverbBus *bus, float *buffer, int n_samples);
+void reverb_bus_clear(ReverbBus *bus);
+
+#endif
@@ -0,0 +1,454 @@
+/**
+    @file reverb_offline.c
+    @brief Offline (non real-time) rendering for the Dattoro reverb.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+#include "reverb_offline.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define MIN_CONVOLUTION_BLOCK 1024
+#define MAX_CONVOLUTION_BLOCK 65536
+
+// Build the bit reversal and twiddle tables for an n point FFT (n a power of two)
+static void fft_init(FFTPlan *plan, int n)
+{
+    int bits = 0;
+    while ((1 << bits) < n)
+        bits++;
+
+    plan->n = n;
+    plan->bitrev = (int *)malloc(sizeof(*plan->bitrev) * n);
+    plan->twiddles = (float *)malloc(sizeof(*plan->twiddles) * n);
+    for (int i = 0; i < n; i++)
+    {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        plan->bitrev[i] = r;
+    }
+    for (int k = 0; k < n / 2; k++)
+    {
+        plan->twiddles[2 * k] = cos(2 * M_PI * k / n);
+        plan->twiddles[2 * k + 1] = -sin(2 * M_PI * k / n);
+    }
+}
+
+static void fft_free(FFTPlan *plan)
+{
+    free(plan->bitrev);
+    free(plan->twiddles);
+}
+
+// In-place radix-2 FFT of n interleaved complex values; unscaled in both directions
+static void fft(const FFTPlan *plan, float *data, int inverse)
+{
+    int n = plan->n;
+    float sign = inverse ? -1.0 : 1.0;
+
+    for (int i = 0; i < n; i++)
+    {
+        int j = plan->bitrev[i];
+        if (j > i)
+        {
+            float re = data[2 * i], im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+
+    for (int size = 2; size <= n; size *= 2)
+    {
+        int half = size / 2;
+        int step = n / size;
+        for (int start = 0; start < n; start += size)
+        {
+            for (int k = 0; k < half; k++)
+            {
+                float wr = plan->twiddles[2 * k * step];
+                float wi = sign * plan->twiddles[2 * k * step + 1];
+                float *a = data + 2 * (start + k);
+                float *b = a + 2 * half;
+                float tr = wr * b[0] - wi * b[1];
+                float ti = wr * b[1] + wi * b[0];
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+// Choose a partition size for an impulse response: offline there is no latency
+// constraint, so use large blocks to keep the number of partitions small
+static int choose_block_size(int ir_frames)
+{
+    int block_size = MIN_CONVOLUTION_BLOCK;
+    while (block_size < MAX_CONVOLUTION_BLOCK && block_size * 8 < ir_frames)
+        block_size *= 2;
+    return block_size;
+}
+
+// Partition and transform a stereo impulse response
+// block_size must be a power of two, or <= 0 to choose one automatically
+ConvolutionIR *create_convolution_ir(const float *ir_l, const float *ir_r, int ir_frames, int block_size)
+{
+    ConvolutionIR *ir = (ConvolutionIR *)malloc(sizeof(*ir));
+    int fft_size;
+
+    if (block_size <= 0)
+        block_size = choose_block_size(ir_frames);
+    fft_size = block_size * 2;
+    fft_init(&ir->fft, fft_size);
+    ir->block_size = block_size;
+    ir->ir_frames = ir_frames;
+    ir->n_partitions = (ir_frames + block_size - 1) / block_size;
+    if (ir->n_partitions < 1)
+        ir->n_partitions = 1;
+    ir->spectra = (float *)calloc(sizeof(*ir->spectra), (size_t)ir->n_partitions * fft_size * 2);
+
+    // each partition is zero padded to the FFT size, left in the real part and right in the imaginary part
+    for (int p = 0; p < ir->n_partitions; p++)
+    {
+        float *spectrum = ir->spectra + (size_t)p * fft_size * 2;
+        for (int i = 0; i < block_size && p * block_size + i < ir_frames; i++)
+        {
+            spectrum[2 * i] = ir_l[p * block_size + i];
+            spectrum[2 * i + 1] = ir_r[p * block_size + i];
+        }
+        fft(&ir->fft, spectrum, 0);
+    }
+    return ir;
+}
+
+void destroy_convolution_ir(ConvolutionIR *ir)
+{
+    fft_free(&ir->fft);
+    free(ir->spectra);
+    free(ir);
+}
+
+// Length of an impulse response once everything after the last sample within
+// threshold_db of the peak is dropped
+int trim_impulse_response(const float *ir_l, const float *ir_r, int n_frames, double threshold_db)
+{
+    float peak = 0.0, threshold;
+    int i;
+
+    for (i = 0; i < n_frames; i++)
+        peak = fmaxf(peak, fmaxf(fabsf(ir_l[i]), fabsf(ir_r[i])));
+    threshold = peak * pow(10.0, threshold_db / 20.0);
+    for (i = n_frames; i > 0; i--)
+        if (fabsf(ir_l[i - 1]) > threshold || fabsf(ir_r[i - 1]) > threshold)
+            break;
+    return i;
+}
+
+// Create the state for running a convolution with ir
+Convolver *create_convolver(const ConvolutionIR *ir)
+{
+    Convolver *conv = (Convolver *)malloc(sizeof(*conv));
+    int fft_size = ir->fft.n;
+
+    conv->ir = ir;
+    conv->input = (float *)malloc(sizeof(*conv->input) * fft_size);
+    conv->history = (float *)malloc(sizeof(*conv->history) * (size_t)ir->n_partitions * fft_size * 2);
+    conv->accum = (float *)malloc(sizeof(*conv->accum) * fft_size * 2);
+    reset_convolver(conv);
+    return conv;
+}
+
+void destroy_convolver(Convolver *conv)
+{
+    free(conv->input);
+    free(conv->history);
+    free(conv->accum);
+    free(conv);
+}
+
+// Clear the input history, as if the convolver had only ever seen silence
+void reset_convolver(Convolver *conv)
+{
+    int fft_size = conv->ir->fft.n;
+    memset(conv->input, 0, sizeof(*conv->input) * fft_size);
+    memset(conv->history, 0, sizeof(*conv->history) * (size_t)conv->ir->n_partitions * fft_size * 2);
+    conv->position = 0;
+}
+
+// Convolve one block of block_size mono input samples, writing block_size
+// samples of each output channel. There is no added latency.
+void convolver_process(Convolver *conv, const float *in, float *out_l, float *out_r)
+{
+    const ConvolutionIR *ir = conv->ir;
+    int block_size = ir->block_size;
+    int fft_size = ir->fft.n;
+    int n_partitions = ir->n_partitions;
+    float *spectrum = conv->history + (size_t)conv->position * fft_size * 2;
+    float scale = 1.0 / fft_size;
+
+    // overlap-save: transform the previous and current input blocks
+    memmove(conv->input, conv->input + block_size, sizeof(*conv->input) * block_size);
+    memcpy(conv->input + block_size, in, sizeof(*conv->input) * block_size);
+    for (int i = 0; i < fft_size; i++)
+    {
+        spectrum[2 * i] = conv->input[i];
+        spectrum[2 * i + 1] = 0.0;
+    }
+    fft(&ir->fft, spectrum, 0);
+
+    // multiply-accumulate each past input spectrum with its partition
+    memset(conv->accum, 0, sizeof(*conv->accum) * fft_size * 2);
+    for (int p = 0; p < n_partitions; p++)
+    {
+        int slot = conv->position - p;
+        if (slot < 0)
+            slot += n_partitions;
+        const float *x = conv->history + (size_t)slot * fft_size * 2;
+        const float *h = ir->spectra + (size_t)p * fft_size * 2;
+        for (int i = 0; i < fft_size; i++)
+        {
+            float xr = x[2 * i], xi = x[2 * i + 1];
+            float hr = h[2 * i], hi = h[2 * i + 1];
+            conv->accum[2 * i] += xr * hr - xi * hi;
+            conv->accum[2 * i + 1] += xr * hi + xi * hr;
+        }
+    }
+    conv->position++;
+    if (conv->position >= n_partitions)
+        conv->position = 0;
+
+    // the second half of the result is the linear convolution; left is real, right is imaginary
+    fft(&ir->fft, conv->accum, 1);
+    for (int i = 0; i < block_size; i++)
+    {
+        out_l[i] = conv->accum[2 * (block_size + i)] * scale;
+        out_r[i] = conv->accum[2 * (block_size + i) + 1] * scale;
+    }
+}
+
+// One time segment of an offline convolution: the response to the input
+// in [start, end), including its tail, up to n_frames
+typedef struct ConvolutionSegment
+{
+    const ConvolutionIR *ir;
+    const float *input;
+    int n_frames;
+    int start;
+    int end;
+    int out_frames;
+    float *wet;
+} ConvolutionSegment;
+
+static void *convolve_segment(void *arg)
+{
+    ConvolutionSegment *segment = (ConvolutionSegment *)arg;
+    int block_size = segment->ir->block_size;
+    Convolver *conv = create_convolver(segment->ir);
+    float *in = (float *)malloc(sizeof(*in) * block_size * 3);
+    float *out_l = in + block_size;
+    float *out_r = out_l + block_size;
+
+    for (int t = 0; t < segment->out_frames; t += block_size)
+    {
+        for (int i = 0; i < block_size; i++)
+        {
+            int frame = segment->start + t + i;
+            in[i] = (frame < segment->end) ? segment->input[frame] : 0.0;
+        }
+        convolver_process(conv, in, out_l, out_r);
+        for (int i = 0; i < block_size && t + i < segment->out_frames; i++)
+        {
+            segment->wet[2 * (t + i)] = out_l[i];
+            segment->wet[2 * (t + i) + 1] = out_r[i];
+        }
+    }
+    free(in);
+    destroy_convolver(conv);
+    return NULL;
+}
+
+// Equivalent of stereo_reverb_buffer, rendering the wet signal by convolving
+// with ir (normally from reverb_impulse_response) instead of running the network.
+// The buffer is split into time segments which are convolved on n_threads
+// threads (<= 0 for one per core), and their overlapping tails summed.
+// Only matches the network if reverb_is_time_invariant, and for true stereo
+// only on centred input, as the input is mixed to mono; the reverb is not modified.
+void convolution_reverb_buffer(const DattoroReverb *reverb, const ConvolutionIR *ir, float *buffer, int n_samples, int n_threads)
+{
+    int n_frames = n_samples / 2;
+    int n_segments;
+    float *input;
+    ConvolutionSegment *segments;
+    pthread_t *threads;
+
+    if (n_threads <= 0)
+        n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1)
+        n_threads = 1;
+
+    // every segment pays for rendering a full tail, so keep them longer than the IR
+    n_segments = n_threads;
+    if (ir->ir_frames > 0 && n_frames / ir->ir_frames < n_segments)
+        n_segments = n_frames / ir->ir_frames;
+    if (n_segments < 1)
+        n_segments = 1;
+
+    input = (float *)malloc(sizeof(*input) * (n_frames > 0 ? n_frames : 1));
+    for (int i = 0; i < n_frames; i++)
+        input[i] = (buffer[2 * i] + buffer[2 * i + 1]) / 2.0;
+
+    segments = (ConvolutionSegment *)malloc(sizeof(*segments) * n_segments);
+    threads = (pthread_t *)malloc(sizeof(*threads) * n_segments);
+    for (int s = 0; s < n_segments; s++)
+    {
+        ConvolutionSegment *segment = &segments[s];
+        segment->ir = ir;
+        segment->input = input;
+        segment->n_frames = n_frames;
+        segment->start = (int)((long long)n_frames * s / n_segments);
+        segment->end = (int)((long long)n_frames * (s + 1) / n_segments);
+        segment->out_frames = segment->end - segment->start + ir->ir_frames;
+        if (segment->start + segment->out_frames > n_frames)
+            segment->out_frames = n_frames - segment->start;
+        segment->wet = (float *)malloc(sizeof(*segment->wet) * 2 * (segment->out_frames > 0 ? segment->out_frames : 1));
+        if (n_segments == 1 || pthread_create(&threads[s], NULL, convolve_segment, segment) != 0)
+        {
+            convolve_segment(segment);
+            threads[s] = pthread_self();
+        }
+    }
+
+    for (int s = 0; s < n_segments; s++)
+        if (!pthread_equal(threads[s], pthread_self()))
+            pthread_join(threads[s], NULL);
+
+    // mix: dry signal, plus the overlapping wet segments
+    for (int i = 0; i < n_frames * 2; i++)
+        buffer[i] *= reverb->dry_gain;
+    for (int s = 0; s < n_segments; s++)
+    {
+        float *out = buffer + 2 * segments[s].start;
+        for (int i = 0; i < segments[s].out_frames * 2; i++)
+            out[i] += reverb->wet_gain * segments[s].wet[i];
+        free(segments[s].wet);
+    }
+
+    free(threads);
+    free(segments);
+    free(input);
+}
+
+// One time segment of a segmented render: a clone of the reverb, started at
+// time start, rendering the input in [start, end) and its
+// tail, up to out_frames frames
+typedef struct ReverbSegment
+{
+    const DattoroReverb *reverb;
+    const float *buffer;
+    int start;
+    int end;
+    int out_frames;
+    float *wet;
+} ReverbSegment;
+
+static void *render_segment(void *arg)
+{
+    ReverbSegment *segment = (ReverbSegment *)arg;
+    DattoroReverb *reverb = reverb_clone(segment->reverb);
+    const float *in = segment->buffer + 2 * segment->start;
+    int n_input = segment->end - segment->start;
+
+    // the first segment continues from the reverb's own state; the others
+    // start silent, with the modulation where it would be at their start time
+    if (segment->start > 0)
+    {
+        reverb_clear(reverb);
+        reverb_skip_modulation(reverb, segment->start);
+    }
+
+    // render the wet signal alone, through the buffer function so a
+    // decimated tank is resampled as it would be serially
+    reverb->dry_gain = 0.0;
+    reverb->wet_gain = 1.0;
+    memcpy(segment->wet, in, sizeof(*segment->wet) * 2 * n_input);
+    memset(segment->wet + 2 * n_input, 0, sizeof(*segment->wet) * 2 * (segment->out_frames - n_input));
+    stereo_reverb_buffer(reverb, segment->wet, 2 * segment->out_frames);
+    destroy_reverb(reverb);
+    return NULL;
+}
+
+// Equivalent of stereo_reverb_buffer, splitting the buffer into time segments
+// rendered on n_threads threads (<= 0 for one per core). Each segment runs its
+// own copy of the reverb over its input plus tail_frames of tail, and the
+// overlapping outputs are summed. The network is linear and its modulation
+// does not depend on the signal, so this matches a serial render up to the
+// tail truncation, with or without modulation. The reverb is not modified.
+void segmented_reverb_buffer(const DattoroReverb *reverb, float *buffer, int n_samples, int tail_frames, int n_threads)
+{
+    int n_frames = n_samples / 2;
+    int n_segments;
+    ReverbSegment *segments;
+    pthread_t *threads;
+
+    if (n_threads <= 0)
+        n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1)
+        n_threads = 1;
+
+    // every segment pays for rendering its tail, so keep them longer than it
+    n_segments = n_threads;
+    if (tail_frames > 0 && n_frames / tail_frames < n_segments)
+        n_segments = n_frames / tail_frames;
+    if (n_segments < 1)
+        n_segments = 1;
+
+    segments = (ReverbSegment *)malloc(sizeof(*segments) * n_segments);
+    threads = (pthread_t *)malloc(sizeof(*threads) * n_segments);
+    for (int s = 0; s < n_segments; s++)
+    {
+        ReverbSegment *segment = &segments[s];
+        segment->reverb = reverb;
+        segment->buffer = buffer;
+        segment->start = (int)((long long)n_frames * s / n_segments);
+        segment->end = (int)((long long)n_frames * (s + 1) / n_segments);
+        // the last segment runs to the end; earlier ones stop after their tail
+        segment->out_frames = n_frames - segment->start;
+        if (s < n_segments - 1 && segment->end - segment->start + tail_frames < segment->out_frames)
+            segment->out_frames = segment->end - segment->start + tail_frames;
+        segment->wet = (float *)malloc(sizeof(*segment->wet) * 2 * (segment->out_frames > 0 ? segment->out_frames : 1));
+        if (n_segments == 1 || pthread_create(&threads[s], NULL, render_segment, segment) != 0)
+        {
+            render_segment(segment);
+            threads[s] = pthread_self();
+        }
+    }
+
+    for (int s = 0; s < n_segments; s++)
+        if (!pthread_equal(threads[s], pthread_self()))
+            pthread_join(threads[s], NULL);
+
+    // mix: dry signal, plus the overlapping wet segments
+    for (int i = 0; i < n_frames * 2; i++)
+        buffer[i] *= reverb->dry_gain;
+    for (int s = 0; s < n_segments; s++)
+    {
+        float *out = buffer + 2 * segments[s].start;
+        for (int i = 0; i < segments[s].out_frames * 2; i++)
+            out[i] += reverb->wet_gain * segments[s].wet[i];
+        free(segments[s].wet);
+    }
+
+    free(threads);
+    free(segments);
+}
@@ -0,0 +1,63 @@
+/**
+    @file reverb_offline.h
+    @brief Offline (non real-time) rendering for the Dattoro reverb.
+    Splits long renders across threads, either by replacing the recursive network
+    with a uniformly partitioned FFT convolution with its impulse response, or by
+    running copies of the network on overlapping time segments.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+
+#ifndef __REVERB_OFFLINE_H__
+#define __REVERB_OFFLINE_H__
+#include "reverb.h"
+
+/** @struct FFTPlan Tables for a power-of-two complex FFT */
+typedef struct FFTPlan
+{
+    int n;
+    int *bitrev;
+    float *twiddles;
+} FFTPlan;
+
+/** @struct ConvolutionIR A stereo impulse response, split into partitions of
+    block_size frames and transformed. Left and right are packed into the real and
+    imaginary parts of one spectrum, so one transform convolves both channels.
+    Read only once created, so may be shared between threads. */
+typedef struct ConvolutionIR
+{
+    FFTPlan fft;
+    int block_size;
+    int n_partitions;
+    int ir_frames;
+    float *spectra;
+} ConvolutionIR;
+
+/** @struct Convolver The running state of a mono-in, stereo-out
+    overlap-save convolution with a ConvolutionIR */
+typedef struct Convolver
+{
+    const ConvolutionIR *ir;
+    float *input;
+    float *history;
+    float *accum;
+    int position;
+} Convolver;
+
+ConvolutionIR *create_convolution_ir(const float *ir_l, const float *ir_r, int ir_frames, int block_size);
+void destroy_convolution_ir(ConvolutionIR *ir);
+int trim_impulse_response(const float *ir_l, const float *ir_r, int n_frames, double threshold_db);
+
+Convolver *create_convolver(const ConvolutionIR *ir);
+void destroy_convolver(Convolver *conv);
+void reset_convolver(Convolver *conv);
+void convolver_process(Convolver *conv, const float *in, float *out_l, float *out_r);
+
+void convolution_reverb_buffer(const DattoroReverb *reverb, const ConvolutionIR *ir, float *buffer, int n_samples, int n_threads);
+void segmented_reverb_buffer(const DattoroReverb *reverb, float *buffer, int n_samples, int tail_frames, int n_threads);
+
+#endif
@@ -0,0 +1,198 @@
+/**
+    @file reverb_pool.c
+    @brief A pool of preallocated Dattoro reverbs.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+#include "reverb_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// Size of a huge page, which huge page allocations are rounded up to
+#define HUGEPAGE_BYTES ((size_t)2 << 20)
+
+// Cache line aligned heap memory, the default
+static void *heap_alloc(size_t bytes, void *user)
+{
+    (void)user;
+    return aligned_alloc(64, (bytes + 63) & ~(size_t)63);
+}
+
+static void heap_free(void *memory, size_t bytes, void *user)
+{
+    (void)bytes;
+    (void)user;
+    free(memory);
+}
+
+static ReverbAllocator allocator = {heap_alloc, heap_free, NULL};
+
+// Make allocator (copied) the source of memory for pools created from now on,
+// or with NULL, the heap again. Not thread safe: set it up before creating pools
+void reverb_set_allocator(const ReverbAllocator *new_allocator)
+{
+    static const ReverbAllocator heap = {heap_alloc, heap_free, NULL};
+
+    allocator = new_allocator ? *new_allocator : heap;
+}
+
+#ifdef __linux__
+// Memory from the reserved huge pages (MAP_HUGETLB) if there are enough free,
+// otherwise ordinary pages aligned to a huge page and marked for transparent
+// huge pages, which the kernel backs with huge pages as it can
+static void *hugepage_alloc(size_t bytes, void *user)
+{
+    size_t rounded = (bytes + HUGEPAGE_BYTES - 1) & ~(HUGEPAGE_BYTES - 1);
+    unsigned char *memory;
+    size_t head;
+
+    (void)user;
+#ifdef MAP_HUGETLB
+    memory = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED)
+        return memory;
+#endif
+    // map a huge page more than needed, and trim it to a huge page boundary
+    memory = mmap(NULL, rounded + HUGEPAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+    head = (HUGEPAGE_BYTES - (uintptr_t)memory % HUGEPAGE_BYTES) % HUGEPAGE_BYTES;
+    if (head > 0)
+        munmap(memory, head);
+    munmap(memory + head + rounded, HUGEPAGE_BYTES - head);
+    memory += head;
+#ifdef MADV_HUGEPAGE
+    madvise(memory, rounded, MADV_HUGEPAGE);
+#endif
+    return memory;
+}
+
+static void hugepage_free(void *memory, size_t bytes, void *user)
+{
+    (void)user;
+    munmap(memory, (bytes + HUGEPAGE_BYTES - 1) & ~(HUGEPAGE_BYTES - 1));
+}
+
+// The built-in huge page allocator, for reverb_set_allocator, or NULL where
+// huge pages are not supported
+const ReverbAllocator *reverb_hugepage_allocator(void)
+{
+    static const ReverbAllocator hugepage = {hugepage_alloc, hugepage_free, NULL};
+
+    return &hugepage;
+}
+#else
+const ReverbAllocator *reverb_hugepage_allocator(void)
+{
+    return NULL;
+}
+#endif
+
+// Create a pool of n_instances reverbs laid out in place for config, all
+// free and at the default settings, in memory from the current allocator.
+// Returns NULL if the config is invalid or the memory cannot be allocated
+ReverbPool *create_reverb_pool(const ReverbConfig *config, int n_instances)
+{
+    size_t instance_bytes = reverb_required_bytes(config);
+    ReverbPool *pool;
+    DelayLine *delays[REVERB_ALL_DELAYS];
+
+    if (instance_bytes == 0 || n_instances < 1)
+        return NULL;
+    pool = (ReverbPool *)malloc(sizeof(*pool));
+    pool->config = *config;
+    pool->n_instances = n_instances;
+    pool->instance_bytes = instance_bytes;
+    // instances are a whole number of cache lines, so each starts on one
+    pool->allocator = allocator;
+    pool->memory = (unsigned char *)allocator.alloc(instance_bytes * n_instances, allocator.user);
+    if (!pool->memory)
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->next = (_Atomic int *)malloc(sizeof(*pool->next) * n_instances);
+    for (int i = 0; i < n_instances; i++)
+    {
+        reverb_init_in_place(pool->memory + i * instance_bytes, instance_bytes, config);
+        atomic_init(&pool->next[i], i + 1 < n_instances ? i + 2 : 0);
+    }
+    atomic_init(&pool->head, 1);
+
+    pool->defaults = *(DattoroReverb *)pool->memory;
+    reverb_delays(&pool->defaults, delays);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+        pool->default_delays[i] = *delays[i];
+    return pool;
+}
+
+// Destroy a pool, and with it every instance, acquired or not
+void destroy_reverb_pool(ReverbPool *pool)
+{
+    pool->allocator.free(pool->memory, pool->instance_bytes * pool->n_instances, pool->allocator.user);
+    free((void *)pool->next);
+    free(pool);
+}
+
+// Take a free reverb from the pool, at the default settings and silent, or
+// NULL if all are in use. Lock-free, and safe from any thread
+DattoroReverb *reverb_pool_acquire(ReverbPool *pool)
+{
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire), next;
+    int index;
+
+    do
+    {
+        index = (int)(head & 0xffffffff) - 1;
+        if (index < 0)
+            return NULL;
+        // next[index] may be stale if another thread took index meanwhile,
+        // but then the count in head has moved on and the swap fails
+        next = ((head >> 32) + 1) << 32 |
+               (uint32_t)atomic_load_explicit(&pool->next[index], memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, next, memory_order_acquire,
+                                                    memory_order_acquire));
+    return (DattoroReverb *)(pool->memory + index * pool->instance_bytes);
+}
+
+// Return a reverb to the pool. It is silenced, clearing only the part of
+// each delay line that has held signal, and its settings, modulation and
+// filter state are copied back from the defaults, so nothing is recomputed.
+// Lock-free, and safe from any thread, but the reverb must not be used after
+void reverb_pool_release(ReverbPool *pool, DattoroReverb *reverb)
+{
+    int index = (int)(((unsigned char *)reverb - pool->memory) / pool->instance_bytes);
+    DelayLine *delays[REVERB_ALL_DELAYS];
+    struct ReverbMultirate *multirate = reverb->multirate;
+    struct ReverbLoadMeter *load_meter = reverb->load_meter;
+    uint64_t head, next;
+
+    reverb_reset(reverb);
+    reverb_delays(reverb, delays);
+    *reverb = pool->defaults;
+    reverb_set_delays(reverb, delays);
+    reverb->multirate = multirate;
+    reverb->load_meter = load_meter;
+    reverb_enable_load_meter(reverb, false);
+    for (int i = 0; i < REVERB_ALL_DELAYS; i++)
+    {
+        float *samples = delays[i]->samples;
+        *delays[i] = pool->default_delays[i];
+        delays[i]->samples = samples;
+    }
+
+    head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    do
+    {
+        atomic_store_explicit(&pool->next[index], (int)(head & 0xffffffff), memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | (uint32_t)(index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, next, memory_order_release,
+                                                    memory_order_relaxed));
+}
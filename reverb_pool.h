@@ -0,0 +1,60 @@
+/**
+    @file reverb_pool.h
+    @brief A pool of preallocated Dattoro reverbs for voice systems: every
+    instance is laid out in place in one block at creation, handed out and
+    taken back in constant time from a lock-free free list, and returned to
+    its defaults on release without allocating or recomputing parameters.
+    The block comes from a replaceable allocator, such as one backed by huge
+    pages, so a large bank of instances needs few TLB entries.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+
+#ifndef __REVERB_POOL_H__
+#define __REVERB_POOL_H__
+#include "reverb.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+/** @struct ReverbAllocator Where the memory of reverb pools comes from.
+    alloc returns bytes of memory aligned to at least a cache line, or NULL;
+    free releases it, and is given the same size */
+typedef struct ReverbAllocator
+{
+    void *(*alloc)(size_t bytes, void *user);
+    void (*free)(void *memory, size_t bytes, void *user);
+    void *user;
+} ReverbAllocator;
+
+/** @struct ReverbPool n_instances in-place reverbs, instance_bytes apart in
+    memory. Free instances are a Treiber stack linked through next, whose
+    head holds the top index + 1 (0 for empty) in its low 32 bits and a count
+    of changes in its high 32, so a stale compare-and-swap always fails */
+typedef struct ReverbPool
+{
+    ReverbConfig config;
+    int n_instances;
+    size_t instance_bytes;
+    unsigned char *memory;
+    // the allocator memory came from, to give it back to
+    ReverbAllocator allocator;
+    // the settings and delay line states every instance starts from
+    DattoroReverb defaults;
+    DelayLine default_delays[REVERB_ALL_DELAYS];
+    _Atomic uint64_t head;
+    _Atomic int *next;
+} ReverbPool;
+
+void reverb_set_allocator(const ReverbAllocator *allocator);
+const ReverbAllocator *reverb_hugepage_allocator(void);
+
+ReverbPool *create_reverb_pool(const ReverbConfig *config, int n_instances);
+void destroy_reverb_pool(ReverbPool *pool);
+DattoroReverb *reverb_pool_acquire(ReverbPool *pool);
+void reverb_pool_release(ReverbPool *pool, DattoroReverb *reverb);
+
+#endif
@@ -4,171 +4,2318 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __NR_perf_event_open
+#define HAVE_PERF_EVENTS 1
+#endif
+#endif
+#endif
 #include "reverb.h"
+#include "reverb_offline.h"
+#include "reverb_bus.h"
+#include "reverb_pool.h"
+#include "wav_io.h"
+#include "async_io.h"
 
-static void writeWavStereo16(const char *filename,
-                             const float *samples,
-                             int numSamples,
-                             int sampleRate)
-{
-    /* RIFF header fields */
-    uint32_t dataSize = numSamples * sizeof(int16_t) * 2;
-    uint32_t fileSize = 36 + dataSize; /* 36 + subchunk2Size */
-    uint16_t channels = 2;
-    uint16_t bitsPerSample = 16;
-    uint16_t audioFormat = 1; /* PCM */
-    uint32_t byteRate = sampleRate * channels * (bitsPerSample / 8);
-    uint16_t blockAlign = channels * (bitsPerSample / 8);
-
-    FILE *fp = fopen(filename, "wb");
-    if (!fp)
+#define RENDER_CHUNK_FRAMES 4096
+#define PIPELINE_CHUNKS 8 /* must be a power of two */
+#define ASYNC_DEPTH 32
+#define MAX_TAIL_SECONDS 60.0
+#define MULTI_BLOCK_FRAMES 16384
+#define MULTI_TILE_FRAMES 256 /* a tile of every channel stays in L1 */
+#define LATENCY_SAMPLE_RATE 48000
+#define LATENCY_CALLS 20000
+#define LATENCY_WARMUP_CALLS 1000
+#define LATENCY_BUCKET_NS 100
+#define LATENCY_BUCKETS 20000
+
+// Report the memory used per reverb instance at common sample rates,
+// both predicted and measured on a live instance, and laid out in place
+static int memoryReport(void)
+{
+    const int sampleRates[] = {22050, 44100, 48000, 88200, 96000, 192000};
+    const double sizes[] = {0.5, 1.0, 2.0};
+    const double maxPredelay = 0.1;
+
+    fprintf(stdout, "%8s %6s %14s %14s %14s %14s %14s\n", "rate", "size", "predicted", "measured", "decimated 2",
+            "decimated 4", "in place");
+    for (int i = 0; i < (int)(sizeof(sampleRates) / sizeof(sampleRates[0])); i++)
     {
-        fprintf(stderr, "Cannot open %s for writing.\n", filename);
-        exit(1);
+        for (int j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+        {
+            DattoroReverb *reverb = create_reverb(sampleRates[i]);
+            ReverbConfig config = {sampleRates[i], sizes[j], maxPredelay, 1, REVERB_QUALITY_FULL};
+            size_t bytes[3];
+            set_reverb_param(reverb, REVERB_SIZE, sizes[j]);
+            set_reverb_param(reverb, REVERB_PREDELAY, maxPredelay);
+            bytes[0] = reverb_instance_bytes(reverb);
+            reverb_set_decimation(reverb, 2);
+            bytes[1] = reverb_instance_bytes(reverb);
+            reverb_set_decimation(reverb, 4);
+            bytes[2] = reverb_instance_bytes(reverb);
+            fprintf(stdout, "%8d %6.2f %14zu %14zu %14zu %14zu %14zu\n", sampleRates[i], sizes[j],
+                    reverb_memory_bytes(sampleRates[i], sizes[j], maxPredelay), bytes[0], bytes[1], bytes[2],
+                    reverb_required_bytes(&config));
+            destroy_reverb(reverb);
+        }
+    }
+    return 0;
+}
+
+typedef struct LatencyRun
+{
+    int blockFrames;
+    uint32_t histogram[LATENCY_BUCKETS + 1]; /* last bucket is overflow */
+    double minNs, maxNs, meanNs, stddevNs;
+} LatencyRun;
+
+static double nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Time each stereo_reverb_buffer call on small blocks of noise */
+static void *latencyThread(void *arg)
+{
+    LatencyRun *run = (LatencyRun *)arg;
+    DattoroReverb *reverb = create_reverb(LATENCY_SAMPLE_RATE);
+    float *block = (float *)malloc(run->blockFrames * 2 * sizeof(float));
+    double sum = 0, sumSq = 0;
+    uint32_t seed = 1;
+
+    memset(run->histogram, 0, sizeof(run->histogram));
+    run->minNs = 1e30;
+    run->maxNs = 0;
+    for (int call = 0; call < LATENCY_WARMUP_CALLS + LATENCY_CALLS; call++)
+    {
+        for (int i = 0; i < run->blockFrames * 2; i++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            block[i] = (int32_t)seed * (0.25f / 2147483648.0f);
+        }
+        double start = nowNs();
+        stereo_reverb_buffer(reverb, block, run->blockFrames * 2);
+        double elapsed = nowNs() - start;
+        if (call < LATENCY_WARMUP_CALLS)
+            continue;
+
+        int bucket = (int)(elapsed / LATENCY_BUCKET_NS);
+        run->histogram[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS]++;
+        if (elapsed < run->minNs)
+            run->minNs = elapsed;
+        if (elapsed > run->maxNs)
+            run->maxNs = elapsed;
+        sum += elapsed;
+        sumSq += elapsed * elapsed;
+    }
+    run->meanNs = sum / LATENCY_CALLS;
+    run->stddevNs = sqrt(fmax(0.0, sumSq / LATENCY_CALLS - run->meanNs * run->meanNs));
+    free(block);
+    destroy_reverb(reverb);
+    return NULL;
+}
+
+/* Latency of the given percentile, from the upper edge of its histogram bucket */
+static double latencyPercentile(const LatencyRun *run, double percentile)
+{
+    uint32_t target = (uint32_t)ceil(percentile / 100.0 * LATENCY_CALLS);
+    uint32_t count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        count += run->histogram[i];
+        if (count >= target)
+            return (i + 1) * (double)LATENCY_BUCKET_NS;
+    }
+    return run->maxNs;
+}
+
+/* Run the latency benchmark for each block size on a SCHED_FIFO thread if permitted */
+static int latencyBenchmark(int nBlockSizes, const int *blockSizes)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    LatencyRun *run = (LatencyRun *)malloc(sizeof(*run));
+    int realtime = 1;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        fprintf(stderr, "mlockall failed (%s); page faults may show in the results\n", strerror(errno));
+
+    fprintf(stdout, "%6s %10s %10s %10s %10s %10s %10s %10s %8s\n", "frames", "min us", "mean us", "p50 us",
+            "p99 us", "p99.9 us", "max us", "jitter us", "max load");
+    for (int b = 0; b < nBlockSizes; b++)
+    {
+        pthread_t thread;
+        run->blockFrames = blockSizes[b];
+
+        pthread_attr_init(&attr);
+        if (realtime)
+        {
+            param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            pthread_attr_setschedparam(&attr, &param);
+        }
+        if (pthread_create(&thread, &attr, latencyThread, run) != 0)
+        {
+            if (!realtime)
+            {
+                fprintf(stderr, "Cannot create benchmark thread.\n");
+                exit(1);
+            }
+            fprintf(stderr, "SCHED_FIFO not permitted; running at normal priority\n");
+            realtime = 0;
+            pthread_attr_destroy(&attr);
+            b--;
+            continue;
+        }
+        pthread_join(thread, NULL);
+        pthread_attr_destroy(&attr);
+
+        double budgetNs = 1e9 * run->blockFrames / LATENCY_SAMPLE_RATE;
+        fprintf(stdout, "%6d %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %7.2f%%\n", run->blockFrames,
+                run->minNs / 1e3, run->meanNs / 1e3, latencyPercentile(run, 50.0) / 1e3,
+                latencyPercentile(run, 99.0) / 1e3, latencyPercentile(run, 99.9) / 1e3, run->maxNs / 1e3,
+                run->stddevNs / 1e3, 100.0 * run->maxNs / budgetNs);
+    }
+    fprintf(stdout, "%d calls per block size at %d Hz, %s scheduling\n", LATENCY_CALLS, LATENCY_SAMPLE_RATE,
+            realtime ? "SCHED_FIFO" : "normal");
+    free(run);
+    return 0;
+}
+
+/* A file name with a suffix appended */
+static char *suffixedName(const char *name, const char *suffix)
+{
+    char *suffixed = (char *)malloc(strlen(name) + strlen(suffix) + 1);
+    strcpy(suffixed, name);
+    strcat(suffixed, suffix);
+    return suffixed;
+}
+
+/* Output file name for an input file */
+static char *outputName(const char *input)
+{
+    return suffixedName(input, "_reverb.wav");
+}
+
+/* Output format of the streamed renders, chosen with --format and --dither */
+static int outputBits = 16;
+static int outputFloat = 0;
+static int outputDither = 0;
+
+/* How far below full scale the tail is rendered to, chosen with --tail-db */
+static double tailLevelDb = 96.0;
+
+/* Rate reduction of the reverb tank, chosen with --decimate */
+static int tankDecimation = 1;
+
+/* Quality tier of the reverbs, chosen with --quality */
+static const char *qualityNames[REVERB_QUALITY_MAX] = {"full", "no-mod", "reduced-taps", "half-rate"};
+static int reverbQuality = REVERB_QUALITY_FULL;
+
+/* True stereo input, chosen with --true-stereo */
+static int trueStereo = 0;
+
+/* Seconds of input between checkpoints of the default render, chosen with
+   --checkpoint; 0 for none */
+static double checkpointSeconds = 0.0;
+
+/* Create a reverb for rendering, with the chosen tank decimation, quality and input */
+static DattoroReverb *createReverb(int sampleRate)
+{
+    DattoroReverb *reverb = create_reverb(sampleRate);
+    reverb_set_decimation(reverb, tankDecimation);
+    reverb_set_quality(reverb, reverbQuality);
+    reverb_set_true_stereo(reverb, trueStereo);
+    return reverb;
+}
+
+/* Time stereo_reverb_buffer at each quality tier on blocks of noise, and the
+   cost of the crossfade while switching tiers */
+static int qualityBenchmark(void)
+{
+    const int sampleRates[] = {48000, 96000};
+    const int blockFrames = 256;
+    const int blocks = 1000;
+    float *block = (float *)malloc(blockFrames * 2 * sizeof(float));
+    float *noise = (float *)malloc(blockFrames * 2 * sizeof(float));
+    uint32_t seed = 1;
+
+    for (int i = 0; i < blockFrames * 2; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        noise[i] = (int32_t)seed * (0.25f / 2147483648.0f);
+    }
+    fprintf(stdout, "%8s %-14s %10s %10s %8s\n", "rate", "quality", "ns/frame", "voices", "cost");
+    for (int r = 0; r < (int)(sizeof(sampleRates) / sizeof(sampleRates[0])); r++)
+    {
+        double fullNs = 0.0;
+        for (int q = 0; q <= REVERB_QUALITY_MAX; q++)
+        {
+            DattoroReverb *reverb = create_reverb(sampleRates[r]);
+            double best = 1e30;
+            // the last row switches between full and no-mod every block, so
+            // a crossfade is always running
+            int crossfading = q == REVERB_QUALITY_MAX;
+
+            reverb_set_quality(reverb, crossfading ? REVERB_QUALITY_FULL : q);
+            for (int run = 0; run < 3; run++)
+            {
+                double start = nowNs();
+                for (int b = 0; b < blocks; b++)
+                {
+                    if (crossfading)
+                        reverb_set_quality(reverb, b & 1);
+                    memcpy(block, noise, blockFrames * 2 * sizeof(float));
+                    stereo_reverb_buffer(reverb, block, blockFrames * 2);
+                }
+                best = fmin(best, (nowNs() - start) / ((double)blocks * blockFrames));
+            }
+            if (q == REVERB_QUALITY_FULL)
+                fullNs = best;
+            // voices is how many instances one core could run in real time
+            fprintf(stdout, "%8d %-14s %10.1f %10.0f %7.0f%%\n", sampleRates[r],
+                    crossfading ? "crossfading" : qualityNames[q], best, 1e9 / (best * sampleRates[r]),
+                    100.0 * best / fullNs);
+            destroy_reverb(reverb);
+        }
+    }
+    fprintf(stdout, "%d blocks of %d stereo frames, best of 3\n", blocks, blockFrames);
+    free(block);
+    free(noise);
+    return 0;
+}
+
+/* Time a reverb running on noise, then frozen on silence after a second of
+   noise, with and without modulation (the unmodulated one plays a cached loop
+   once it has recorded it), and how far the level of the frozen output drifts */
+static int freezeBenchmark(void)
+{
+    const int sampleRate = 48000;
+    const int blockFrames = 256;
+    const int blocks = 2000;
+    const char *names[3] = {"running", "frozen", "frozen no-mod"};
+    float *block = (float *)malloc(blockFrames * 2 * sizeof(float));
+    float *noise = (float *)malloc(blockFrames * 2 * sizeof(float));
+    uint32_t seed = 1;
+    double runningNs = 0.0;
+
+    for (int i = 0; i < blockFrames * 2; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        noise[i] = (int32_t)seed * (0.25f / 2147483648.0f);
+    }
+
+    fprintf(stdout, "%-14s %10s %8s %12s\n", "mode", "ns/frame", "cost", "drift dB");
+    for (int m = 0; m < 3; m++)
+    {
+        DattoroReverb *reverb = create_reverb(sampleRate);
+        double best = 1e30, first = 0.0, last = 0.0;
+
+        set_reverb_param(reverb, REVERB_MODULATION, m == 2 ? 0.0 : 1.0);
+        for (int b = 0; b < sampleRate / blockFrames; b++)
+        {
+            memcpy(block, noise, blockFrames * 2 * sizeof(float));
+            stereo_reverb_buffer(reverb, block, blockFrames * 2);
+        }
+        reverb_set_freeze(reverb, m > 0);
+        // the first runs record the loop; the best is of the rest
+        for (int run = 0; run < 5; run++)
+        {
+            double start = nowNs(), energy = 0.0;
+            for (int b = 0; b < blocks; b++)
+            {
+                if (m == 0)
+                    memcpy(block, noise, blockFrames * 2 * sizeof(float));
+                else
+                    memset(block, 0, blockFrames * 2 * sizeof(float));
+                stereo_reverb_buffer(reverb, block, blockFrames * 2);
+                for (int i = 0; i < blockFrames * 2; i++)
+                    energy += block[i] * block[i];
+            }
+            best = fmin(best, (nowNs() - start) / ((double)blocks * blockFrames));
+            if (run == 0)
+                first = energy;
+            last = energy;
+        }
+        if (m == 0)
+            runningNs = best;
+        fprintf(stdout, "%-14s %10.1f %7.0f%% %12.2f\n", names[m], best, 100.0 * best / runningNs,
+                m == 0 ? 0.0 : 10.0 * log10(last / first));
+        destroy_reverb(reverb);
     }
+    fprintf(stdout, "5 runs of %d blocks of %d stereo frames at %d Hz\n", blocks, blockFrames, sampleRate);
+    free(noise);
+    free(block);
+    return 0;
+}
+
+/* Frames of tail to render after the input: long enough for the reverb to
+   decay by tailLevelDb, up to MAX_TAIL_SECONDS */
+static long tailFrames(const DattoroReverb *reverb)
+{
+    return (long)ceil(fmin(reverb_tail_seconds(reverb, tailLevelDb), MAX_TAIL_SECONDS) * reverb->sample_rate);
+}
+
+/* Create an output file in the chosen format */
+static void openOutput(WavWriter *writer, const char *filename, int sampleRate)
+{
+    WavFormat format;
+    wavStereoFormat(&format, sampleRate, outputBits, outputFloat);
+    wavOpenWrite(writer, filename, &format, outputDither);
+}
 
-    /* Write the RIFF chunk descriptor */
-    fwrite("RIFF", 1, 4, fp);
-    fwrite(&fileSize, 4, 1, fp);
-    fwrite("WAVE", 1, 4, fp);
+/* Render nSources noise sources, each with its own send gain and predelay,
+   through one reverb per source and through a bus sharing one reverb, and
+   compare the time taken and the summed wet output */
+static int busBenchmark(int nSources)
+{
+    const int sampleRate = 48000;
+    const int blockFrames = 256;
+    const int blocks = 400;
+    float *sources = (float *)malloc((size_t)nSources * blockFrames * 2 * sizeof(float));
+    float *block = (float *)malloc(blockFrames * 2 * sizeof(float));
+    float *separate = (float *)calloc(blockFrames * 2, sizeof(float));
+    float *shared = (float *)malloc(blockFrames * 2 * sizeof(float));
+    DattoroReverb **reverbs = (DattoroReverb **)malloc(nSources * sizeof(*reverbs));
+    ReverbBus *bus = create_reverb_bus(sampleRate, nSources, blockFrames);
+    double separateNs = 0.0, sharedNs = 0.0, maxDiff = 0.0, maxOut = 0.0;
+    uint32_t seed = 1;
 
-    /* Write the 'fmt ' sub-chunk */
-    fwrite("fmt ", 1, 4, fp);
+    for (int s = 0; s < nSources; s++)
     {
-        uint32_t subchunkSize = 16; /* PCM */
-        fwrite(&subchunkSize, 4, 1, fp);
-        fwrite(&audioFormat, 2, 1, fp);
-        fwrite(&channels, 2, 1, fp);
-        fwrite(&sampleRate, 4, 1, fp);
-        fwrite(&byteRate, 4, 1, fp);
-        fwrite(&blockAlign, 2, 1, fp);
-        fwrite(&bitsPerSample, 2, 1, fp);
+        // the same gain and predelay on a reverb of its own: the bus's own
+        // 1ms predelay plus the send's
+        double gainDb = -6.0 - (s % 8), predelay = 0.005 * (s % 10);
+        reverbs[s] = create_reverb(sampleRate);
+        set_reverb_param(reverbs[s], REVERB_DRY, -INFINITY);
+        set_reverb_param(reverbs[s], REVERB_WET, -6.0 + gainDb);
+        set_reverb_param(reverbs[s], REVERB_PREDELAY, 0.001 + predelay);
+        reverb_bus_set_send(bus, s, gainDb, predelay);
     }
+    for (int b = 0; b < blocks; b++)
+    {
+        double start;
+        // the sends ramp up from off over the first block, so keep it silent
+        for (int i = 0; i < nSources * blockFrames * 2; i++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            sources[i] = b == 0 ? 0.0f : (int32_t)seed * (0.25f / 2147483648.0f);
+        }
+
+        start = nowNs();
+        memset(separate, 0, blockFrames * 2 * sizeof(float));
+        for (int s = 0; s < nSources; s++)
+        {
+            memcpy(block, sources + (size_t)s * blockFrames * 2, blockFrames * 2 * sizeof(float));
+            stereo_reverb_buffer(reverbs[s], block, blockFrames * 2);
+            for (int i = 0; i < blockFrames * 2; i++)
+                separate[i] += block[i];
+        }
+        separateNs += nowNs() - start;
 
-    /* Write the 'data' sub-chunk */
-    fwrite("data", 1, 4, fp);
-    fwrite(&dataSize, 4, 1, fp);
+        start = nowNs();
+        for (int s = 0; s < nSources; s++)
+            reverb_bus_send_stereo(bus, s, sources + (size_t)s * blockFrames * 2, blockFrames * 2);
+        reverb_bus_render(bus, shared, blockFrames * 2);
+        sharedNs += nowNs() - start;
 
-    /* Write the samples */
-    int16_t *shortSamples = (int16_t *)malloc(numSamples * 2 * sizeof(int16_t));
-    for (int i = 0; i < numSamples * 2; i++)
+        for (int i = 0; i < blockFrames * 2; i++)
+        {
+            maxDiff = fmax(maxDiff, fabs(shared[i] - separate[i]));
+            maxOut = fmax(maxOut, fabs(separate[i]));
+        }
+    }
+    fprintf(stdout, "%d sources, %d blocks of %d frames at %dHz\n", nSources, blocks, blockFrames, sampleRate);
+    fprintf(stdout, "One reverb per source %8.1f ns/frame\n", separateNs / ((double)blocks * blockFrames));
+    fprintf(stdout, "Shared bus            %8.1f ns/frame (%.1fx faster)\n", sharedNs / ((double)blocks * blockFrames),
+            separateNs / sharedNs);
+    fprintf(stdout, "Max difference %.1f dB relative to the peak\n", 20 * log10(fmax(maxDiff / maxOut, 1e-30)));
+
+    for (int s = 0; s < nSources; s++)
+        destroy_reverb(reverbs[s]);
+    destroy_reverb_bus(bus);
+    free(reverbs);
+    free(sources);
+    free(block);
+    free(separate);
+    free(shared);
+    return 0;
+}
+
+/* A thread of the pool benchmark, acquiring and releasing instances and
+   checking no instance is ever held by two threads at once */
+typedef struct PoolWorker
+{
+    pthread_t thread;
+    ReverbPool *pool;
+    atomic_int *held;
+    int cycles;
+    long conflicts;
+    long empty;
+} PoolWorker;
+
+static void *poolWorker(void *arg)
+{
+    PoolWorker *worker = (PoolWorker *)arg;
+    ReverbPool *pool = worker->pool;
+    DattoroReverb *reverbs[4];
+
+    for (int c = 0; c < worker->cycles; c++)
     {
-        shortSamples[i] = (int16_t)(samples[i] * 32768.0f);
+        int n = 1 + c % 4;
+        for (int i = 0; i < n; i++)
+        {
+            reverbs[i] = reverb_pool_acquire(pool);
+            if (!reverbs[i])
+            {
+                worker->empty++;
+                n = i;
+                break;
+            }
+            if (atomic_exchange(&worker->held[((unsigned char *)reverbs[i] - pool->memory) / pool->instance_bytes], 1))
+                worker->conflicts++;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            atomic_store(&worker->held[((unsigned char *)reverbs[i] - pool->memory) / pool->instance_bytes], 0);
+            reverb_pool_release(pool, reverbs[i]);
+        }
     }
+    return NULL;
+}
+
+/* Time the life of a voice's reverb, created and destroyed against acquired
+   from and released to a pool, check a reused instance renders exactly as a
+   new one, then hammer the pool from nThreads threads */
+static int poolBenchmark(int nThreads)
+{
+    const int sampleRate = 48000;
+    const int blockFrames = 256;
+    const int voices = 2000;
+    const int instances = 64;
+    ReverbConfig config = {sampleRate, 2.0, 0.1, 1, REVERB_QUALITY_FULL};
+    ReverbPool *pool = create_reverb_pool(&config, instances);
+    float *noise = (float *)malloc(blockFrames * 2 * sizeof(float));
+    float *block = (float *)malloc(blockFrames * 2 * sizeof(float));
+    float *fresh = (float *)malloc(blockFrames * 2 * sizeof(float));
+    PoolWorker *workers = (PoolWorker *)calloc(nThreads, sizeof(*workers));
+    atomic_int *held = (atomic_int *)calloc(instances, sizeof(*held));
+    double createNs = 0.0, poolNs = 0.0, maxDiff = 0.0, start;
+    long conflicts = 0, empty = 0;
+    uint32_t seed = 1;
+
+    for (int i = 0; i < blockFrames * 2; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        noise[i] = (int32_t)seed * (0.25f / 2147483648.0f);
+    }
+    for (int v = 0; v < voices; v++)
+    {
+        DattoroReverb *reverb;
+        double size = 0.5 + 1.5 * (v % 7) / 6.0;
 
-    fwrite(shortSamples, sizeof(int16_t), numSamples * 2, fp);
-    free(shortSamples);
+        start = nowNs();
+        reverb = create_reverb(sampleRate);
+        set_reverb_param(reverb, REVERB_SIZE, size);
+        createNs += nowNs() - start;
+        memcpy(fresh, noise, blockFrames * 2 * sizeof(float));
+        stereo_reverb_buffer(reverb, fresh, blockFrames * 2);
+        start = nowNs();
+        destroy_reverb(reverb);
+        createNs += nowNs() - start;
 
+        start = nowNs();
+        reverb = reverb_pool_acquire(pool);
+        set_reverb_param(reverb, REVERB_SIZE, size);
+        poolNs += nowNs() - start;
+        memcpy(block, noise, blockFrames * 2 * sizeof(float));
+        stereo_reverb_buffer(reverb, block, blockFrames * 2);
+        start = nowNs();
+        reverb_pool_release(pool, reverb);
+        poolNs += nowNs() - start;
+
+        for (int i = 0; i < blockFrames * 2; i++)
+            maxDiff = fmax(maxDiff, fabs(block[i] - fresh[i]));
+    }
+    fprintf(stdout, "%d voices of %d frames at %dHz, pool of %d (%zu bytes each)\n", voices, blockFrames, sampleRate,
+            instances, pool->instance_bytes);
+    fprintf(stdout, "create_reverb/destroy_reverb %10.0f ns/voice\n", createNs / voices);
+    fprintf(stdout, "Pool acquire/release         %10.0f ns/voice (%.1fx faster)\n", poolNs / voices,
+            createNs / poolNs);
+    fprintf(stdout, "Max difference from a new reverb %g\n", maxDiff);
+
+    start = nowNs();
+    for (int t = 0; t < nThreads; t++)
+    {
+        workers[t].pool = pool;
+        workers[t].held = held;
+        workers[t].cycles = 20000;
+        pthread_create(&workers[t].thread, NULL, poolWorker, &workers[t]);
+    }
+    for (int t = 0; t < nThreads; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        conflicts += workers[t].conflicts;
+        empty += workers[t].empty;
+    }
+    fprintf(stdout, "%d threads: %.0f ns per acquire and release, %ld found the pool empty, %ld conflicts\n", nThreads,
+            (nowNs() - start) / (nThreads * 20000 * 2.5), empty, conflicts);
+
+    destroy_reverb_pool(pool);
+    free(noise);
+    free(block);
+    free(fresh);
+    free(workers);
+    free(held);
+    return conflicts != 0;
+}
+
+/* Open a counter of this thread's data TLB read misses in user space; -1 if
+   the kernel or CPU does not provide one */
+static int openTlbCounter(void)
+{
+#ifdef HAVE_PERF_EVENTS
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+/* Start (or with start 0, stop and read) a counter from openTlbCounter */
+static long long tlbCounter(int fd, int start)
+{
+    long long count = -1;
+
+#ifdef HAVE_PERF_EVENTS
+    if (fd < 0)
+        return -1;
+    if (start)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        return 0;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+#else
+    (void)fd;
+    (void)start;
+#endif
+    return count;
+}
+
+/* Kilobytes of this process's memory in huge pages, transparent or reserved;
+   -1 if unknown */
+static long hugePageKb(void)
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    long kb, total = -1;
+
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 || sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1)
+            total = (total < 0 ? 0 : total) + kb;
     fclose(fp);
+    return total;
 }
 
-void readWavStereo16(const char *filename,
-                     float **samples,
-                     int *numSamples,
-                     int *sampleRate)
+/* Render blocks round-robin through a bank of nInstances pooled reverbs,
+   with the pool's memory from the heap and then from huge pages, and compare
+   the time per frame, the memory backed by huge pages and the data TLB misses */
+static int tlbBenchmark(int nInstances)
+{
+    const int sampleRate = 48000;
+    const int blockFrames = 64;
+    const int rounds = 100;
+    const char *names[2] = {"heap", "hugepage"};
+    const ReverbAllocator *allocators[2] = {NULL, reverb_hugepage_allocator()};
+    ReverbConfig config = {sampleRate, 1.0, 0.1, 1, REVERB_QUALITY_FULL};
+    float *noise = (float *)malloc(blockFrames * 2 * sizeof(float));
+    float *block = (float *)malloc(blockFrames * 2 * sizeof(float));
+    DattoroReverb **reverbs = (DattoroReverb **)malloc(nInstances * sizeof(*reverbs));
+    int tlb = openTlbCounter();
+    int status = 0;
+    uint32_t seed = 1;
+
+    for (int i = 0; i < blockFrames * 2; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        noise[i] = (int32_t)seed * (0.25f / 2147483648.0f);
+    }
+    fprintf(stdout, "%d instances, %.1f MB, blocks of %d frames at %dHz\n", nInstances,
+            reverb_required_bytes(&config) * (double)nInstances / (1 << 20), blockFrames, sampleRate);
+    fprintf(stdout, "%-10s %12s %12s %18s\n", "memory", "ns/frame", "huge pages", "dTLB misses/frame");
+    for (int a = 0; a < 2; a++)
+    {
+        ReverbPool *pool;
+        long hugeKb = hugePageKb(), afterKb;
+        long long misses;
+        double start, ns;
+
+        if (a > 0 && !allocators[a])
+            break;
+        reverb_set_allocator(allocators[a]);
+        pool = create_reverb_pool(&config, nInstances);
+        if (!pool)
+        {
+            fprintf(stderr, "Cannot allocate %d instances from the %s.\n", nInstances, names[a]);
+            status = 1;
+            break;
+        }
+        /* the change is only known if both reads are */
+        afterKb = hugePageKb();
+        hugeKb = hugeKb >= 0 && afterKb >= 0 ? afterKb - hugeKb : -1;
+        for (int i = 0; i < nInstances; i++)
+            reverbs[i] = reverb_pool_acquire(pool);
+
+        // one round to warm up, then the timed ones
+        for (int r = 0; r <= rounds; r++)
+        {
+            if (r == 1)
+            {
+                start = nowNs();
+                tlbCounter(tlb, 1);
+            }
+            for (int i = 0; i < nInstances; i++)
+            {
+                memcpy(block, noise, blockFrames * 2 * sizeof(float));
+                stereo_reverb_buffer(reverbs[i], block, blockFrames * 2);
+            }
+        }
+        misses = tlbCounter(tlb, 0);
+        ns = (nowNs() - start) / ((double)rounds * nInstances * blockFrames);
+
+        fprintf(stdout, "%-10s %12.1f", names[a], ns);
+        if (hugeKb >= 0)
+            fprintf(stdout, " %9.1f MB", hugeKb / 1024.0);
+        else
+            fprintf(stdout, " %12s", "unknown");
+        if (misses >= 0)
+            fprintf(stdout, " %18.4f\n", (double)misses / ((double)rounds * nInstances * blockFrames));
+        else
+            fprintf(stdout, " %18s\n", "unavailable");
+
+        for (int i = 0; i < nInstances; i++)
+            reverb_pool_release(pool, reverbs[i]);
+        destroy_reverb_pool(pool);
+    }
+    reverb_set_allocator(NULL);
+
+    if (tlb >= 0)
+        close(tlb);
+    free(noise);
+    free(block);
+    free(reverbs);
+    return status;
+}
+
+/* Time converting a buffer of float frames to each output format, against a
+   plain copy of the same bytes as a measure of memory bandwidth. The samples
+   overshoot full scale, so saturation is exercised */
+static int outputBenchmark(void)
+{
+    const int frames = 1 << 22;
+    const struct
+    {
+        const char *name;
+        int bits, isFloat, dither;
+    } formats[] = {{"s16", 16, 0, 0}, {"s16 dither", 16, 0, 1}, {"s24", 24, 0, 0}, {"s24 dither", 24, 0, 1}, {"f32", 32, 1, 0}};
+    float *samples = (float *)malloc(frames * 2 * sizeof(float));
+    void *raw = malloc(frames * 2 * sizeof(float));
+    WavDither dither;
+    double best, start;
+
+    for (int i = 0; i < frames * 2; i++)
+        samples[i] = 1.25f * sinf(i * 0.001f);
+    wavDitherInit(&dither, 1);
+
+    best = 1e30;
+    for (int run = 0; run < 5; run++)
+    {
+        start = nowNs();
+        memcpy(raw, samples, frames * 2 * sizeof(float));
+        best = fmin(best, nowNs() - start);
+    }
+    fprintf(stdout, "%-12s %8.2f ns/frame %8.1f MB/s in\n", "copy", best / frames, frames * 8 / best * 1e3);
+    for (int f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); f++)
+    {
+        WavFormat format;
+        wavStereoFormat(&format, 48000, formats[f].bits, formats[f].isFloat);
+        best = 1e30;
+        for (int run = 0; run < 5; run++)
+        {
+            start = nowNs();
+            wavFromFloat(&format, samples, raw, frames, formats[f].dither ? &dither : NULL);
+            best = fmin(best, nowNs() - start);
+        }
+        fprintf(stdout, "%-12s %8.2f ns/frame %8.1f MB/s in\n", formats[f].name, best / frames, frames * 8 / best * 1e3);
+    }
+    fprintf(stdout, "%d stereo frames, best of 5\n", frames);
+    free(samples);
+    free(raw);
+    return 0;
+}
+
+/* Render a file by convolving with the reverb's impulse response on nThreads
+   threads, and compare against the recursive network */
+static int convolveFile(const char *filename, int nThreads)
+{
+    int sampleRate, nSamples;
+    float *samples;
+    readWavStereo(filename, &samples, &nSamples, &sampleRate);
+    fprintf(stdout, "Read %d samples at %d Hz\n", nSamples, sampleRate);
+
+    // modulation makes the network time-variant, so it must be off
+    DattoroReverb *reverb = createReverb(sampleRate);
+    set_reverb_param(reverb, REVERB_SIZE, 0.5);
+    set_reverb_param(reverb, REVERB_WET, -6);
+    set_reverb_param(reverb, REVERB_MODULATION, 0.0);
+    if (!reverb_is_time_invariant(reverb))
+    {
+        fprintf(stderr, "Reverb is modulated; cannot render by convolution.\n");
+        exit(1);
+    }
+    // the impulse response only describes the mixed input
+    if (reverb->true_stereo)
+    {
+        fprintf(stderr, "Reverb is true stereo; cannot render by convolution.\n");
+        exit(1);
+    }
+
+    // capture the impulse response, dropping the inaudible end of the tail
+    int irFrames = 10 * sampleRate;
+    float *irL = (float *)malloc(irFrames * sizeof(float));
+    float *irR = (float *)malloc(irFrames * sizeof(float));
+    double start = nowNs();
+    reverb_impulse_response(reverb, irL, irR, irFrames);
+    irFrames = trim_impulse_response(irL, irR, irFrames, -120.0);
+    ConvolutionIR *ir = create_convolution_ir(irL, irR, irFrames, 0);
+    fprintf(stdout, "Impulse response: %d frames, %d partitions of %d (%.1f ms)\n", irFrames, ir->n_partitions,
+            ir->block_size, (nowNs() - start) / 1e6);
+
+    int reverbSamples = nSamples + tailFrames(reverb);
+    float *convolved = (float *)calloc(reverbSamples * 2, sizeof(float));
+    float *recursive = (float *)calloc(reverbSamples * 2, sizeof(float));
+    memcpy(convolved, samples, nSamples * 2 * sizeof(float));
+    memcpy(recursive, samples, nSamples * 2 * sizeof(float));
+
+    start = nowNs();
+    convolution_reverb_buffer(reverb, ir, convolved, reverbSamples * 2, nThreads);
+    double convolveMs = (nowNs() - start) / 1e6;
+    start = nowNs();
+    stereo_reverb_buffer(reverb, recursive, reverbSamples * 2);
+    double recursiveMs = (nowNs() - start) / 1e6;
+
+    float maxError = 0.0;
+    for (int i = 0; i < reverbSamples * 2; i++)
+        maxError = fmaxf(maxError, fabsf(convolved[i] - recursive[i]));
+    fprintf(stdout, "Convolution %.1f ms, recursive %.1f ms, max difference %.1f dB\n", convolveMs, recursiveMs,
+            20 * log10(maxError + 1e-30));
+
+    char *output = outputName(filename);
+    fprintf(stdout, "Writing %d samples at %d Hz to %s\n", reverbSamples, sampleRate, output);
+    writeWavStereo16(output, convolved, reverbSamples, sampleRate);
+
+    free(output);
+    free(recursive);
+    free(convolved);
+    destroy_convolution_ir(ir);
+    free(irL);
+    free(irR);
+    free(samples);
+    destroy_reverb(reverb);
+    return 0;
+}
+
+/* Render a file in overlapping time segments on nThreads threads, and
+   compare against a serial render */
+static int parallelFile(const char *filename, int nThreads)
+{
+    int sampleRate, nSamples;
+    float *samples;
+    readWavStereo(filename, &samples, &nSamples, &sampleRate);
+    fprintf(stdout, "Read %d samples at %d Hz\n", nSamples, sampleRate);
+
+    DattoroReverb *reverb = createReverb(sampleRate);
+    set_reverb_param(reverb, REVERB_SIZE, 0.5);
+    set_reverb_param(reverb, REVERB_WET, -6);
+    set_reverb_param(reverb, REVERB_MODULATION, 1.0);
+
+    int reverbSamples = nSamples + tailFrames(reverb);
+    float *parallel = (float *)calloc(reverbSamples * 2, sizeof(float));
+    float *serial = (float *)calloc(reverbSamples * 2, sizeof(float));
+    memcpy(parallel, samples, nSamples * 2 * sizeof(float));
+    memcpy(serial, samples, nSamples * 2 * sizeof(float));
+
+    double start = nowNs();
+    segmented_reverb_buffer(reverb, parallel, reverbSamples * 2, 10 * sampleRate, nThreads);
+    double parallelMs = (nowNs() - start) / 1e6;
+    start = nowNs();
+    stereo_reverb_buffer(reverb, serial, reverbSamples * 2);
+    double serialMs = (nowNs() - start) / 1e6;
+
+    float maxError = 0.0;
+    for (int i = 0; i < reverbSamples * 2; i++)
+        maxError = fmaxf(maxError, fabsf(parallel[i] - serial[i]));
+    fprintf(stdout, "Segmented %.1f ms, serial %.1f ms, max difference %.1f dB\n", parallelMs, serialMs,
+            20 * log10(maxError + 1e-30));
+
+    char *output = outputName(filename);
+    fprintf(stdout, "Writing %d samples at %d Hz to %s\n", reverbSamples, sampleRate, output);
+    writeWavStereo16(output, parallel, reverbSamples, sampleRate);
+
+    free(output);
+    free(serial);
+    free(parallel);
+    free(samples);
+    destroy_reverb(reverb);
+    return 0;
+}
+
+/* The tail of a streamed render, which stops once the output has stayed
+   below -tailLevelDb dBFS for as long as sound takes to pass through the
+   predelay and round the tank, or at the estimate from tailFrames */
+typedef struct TailGate
+{
+    long left;
+    long quiet;
+    long hold;
+    float threshold;
+} TailGate;
+
+static void tailStart(TailGate *tail, const DattoroReverb *reverb)
+{
+    tail->left = tailFrames(reverb);
+    tail->quiet = 0;
+    tail->hold = (long)ceil(reverb_tail_seconds(reverb, -INFINITY) * reverb->sample_rate);
+    tail->threshold = pow(10.0, -tailLevelDb / 20.0);
+}
+
+/* Render the next chunk of up to maxFrames of tail; returns its frames, 0 when done */
+static int tailNext(TailGate *tail, DattoroReverb *reverb, float *chunk, int maxFrames)
+{
+    float peak = 0.0f;
+    int frames = tail->left < maxFrames ? tail->left : maxFrames;
+
+    if (tail->quiet >= tail->hold)
+        return 0;
+    memset(chunk, 0, frames * 2 * sizeof(float));
+    stereo_reverb_buffer(reverb, chunk, frames * 2);
+    for (int i = 0; i < frames * 2; i++)
+        peak = fmaxf(peak, fabsf(chunk[i]));
+    tail->quiet = peak < tail->threshold ? tail->quiet + frames : 0;
+    tail->left -= frames;
+    return frames;
+}
+
+/* Checkpoint of a streamed render, taken while the input is rendered: the
+   frames written so far (one per input frame, so also the input frames
+   consumed), the output format and dither state, followed by the reverb's
+   saved state. A render that is stopped resumes from its last checkpoint */
+#define CHECKPOINT_MAGIC 0x4b435652 /* "RVCK" */
+
+typedef struct CheckpointHeader
+{
+    uint32_t magic;
+    int sampleRate;
+    int bitsPerSample;
+    int isFloat;
+    long frames;
+    WavDither dither;
+    uint64_t stateBytes;
+} CheckpointHeader;
+
+/* Write a checkpoint once the output written so far is on disk, through a
+   temporary file renamed over the last one, so a checkpoint is never half
+   written. Failing to write one only warns */
+static void saveCheckpoint(const char *filename, const DattoroReverb *reverb, WavWriter *writer)
+{
+    CheckpointHeader header = {CHECKPOINT_MAGIC, writer->sampleRate, writer->format.bitsPerSample,
+                               writer->format.isFloat, writer->frames, writer->dither,
+                               reverb_state_bytes(reverb)};
+    void *state = malloc(header.stateBytes);
+    char *temp = suffixedName(filename, ".tmp");
+    FILE *fp;
+    int ok;
+
+    reverb_save_state(reverb, state, header.stateBytes);
+    ok = fflush(writer->fp) == 0 && fsync(fileno(writer->fp)) == 0 && (fp = fopen(temp, "wb")) != NULL;
+    if (ok)
+    {
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(state, header.stateBytes, 1, fp) == 1 &&
+             fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        ok = fclose(fp) == 0 && ok && rename(temp, filename) == 0;
+    }
+    if (!ok)
+        fprintf(stderr, "Cannot write checkpoint %s: %s\n", filename, strerror(errno));
+    free(temp);
+    free(state);
+}
+
+/* Load a checkpoint of a render at sampleRate in the chosen format into
+   reverb and header. Returns 0 if there is none, or it does not match, when
+   reverb_load_state has left the reverb as it was to render from the start */
+static int loadCheckpoint(const char *filename, DattoroReverb *reverb, int sampleRate, CheckpointHeader *header)
 {
     FILE *fp = fopen(filename, "rb");
+    void *state = NULL;
+    int ok;
+
     if (!fp)
+        return 0;
+    ok = fread(header, sizeof(*header), 1, fp) == 1 && header->magic == CHECKPOINT_MAGIC &&
+         header->sampleRate == sampleRate && header->bitsPerSample == (outputFloat ? 32 : outputBits) &&
+         header->isFloat == outputFloat && header->frames >= 0 && header->stateBytes < (1u << 30);
+    if (ok)
     {
-        fprintf(stderr, "Cannot open %s for reading.\n", filename);
+        state = malloc(header->stateBytes);
+        ok = fread(state, header->stateBytes, 1, fp) == 1 && reverb_load_state(reverb, state, header->stateBytes);
+    }
+    if (!ok)
+        fprintf(stderr, "Ignoring checkpoint %s, which does not match this render.\n", filename);
+    fclose(fp);
+    free(state);
+    return ok;
+}
+
+/* Stream a WAV file through a reverb in chunks of RENDER_CHUNK_FRAMES,
+   followed by its tail, so memory use is constant, taking a checkpoint every
+   checkpointSeconds of input if checkpoint names a file. Returns the number
+   of input frames */
+static long renderStream(DattoroReverb *reverb, WavReader *reader, WavWriter *writer, float *chunk,
+                         const char *checkpoint)
+{
+    long inputFrames = 0, checkpointFrames = (long)(checkpointSeconds * reader->sampleRate);
+    long sinceCheckpoint = 0;
+    TailGate tail;
+    int frames;
+
+    // render the input, then the tail
+    while ((frames = wavReadFrames(reader, chunk, RENDER_CHUNK_FRAMES)) > 0)
+    {
+        stereo_reverb_buffer(reverb, chunk, frames * 2);
+        wavWriteFrames(writer, chunk, frames);
+        inputFrames += frames;
+        sinceCheckpoint += frames;
+        if (checkpoint && sinceCheckpoint >= checkpointFrames)
+        {
+            saveCheckpoint(checkpoint, reverb, writer);
+            sinceCheckpoint = 0;
+        }
+    }
+    tailStart(&tail, reverb);
+    while ((frames = tailNext(&tail, reverb, chunk, RENDER_CHUNK_FRAMES)) > 0)
+        wavWriteFrames(writer, chunk, frames);
+    return inputFrames;
+}
+
+/* Render a file with the default reverb, resuming from a checkpoint left by
+   an earlier run with --checkpoint. Returns the number of frames written */
+static long renderFile(const char *filename, int verbose)
+{
+    WavReader reader;
+    WavWriter writer;
+    float *chunk = (float *)malloc(RENDER_CHUNK_FRAMES * 2 * sizeof(float));
+
+    if (!wavOpenRead(&reader, filename))
         exit(1);
+    if (verbose)
+        fprintf(stdout, "Reading %ld samples at %d Hz\n", reader.framesLeft, reader.sampleRate);
+    // construct and configure reverb
+    DattoroReverb *reverb = createReverb(reader.sampleRate);
+    set_reverb_param(reverb, REVERB_SIZE, 0.5);
+    set_reverb_param(reverb, REVERB_WET, -6);
+    reverb_enable_load_meter(reverb, true);
+
+    char *output = outputName(filename);
+    char *checkpoint = checkpointSeconds > 0.0 ? suffixedName(output, ".state") : NULL;
+    CheckpointHeader resume;
+    if (checkpoint && loadCheckpoint(checkpoint, reverb, reader.sampleRate, &resume))
+    {
+        if (verbose)
+            fprintf(stdout, "Resuming from sample %ld\n", resume.frames);
+        WavFormat format;
+        wavStereoFormat(&format, reader.sampleRate, outputBits, outputFloat);
+        wavSkipFrames(&reader, resume.frames);
+        wavOpenAppend(&writer, output, &format, outputDither, resume.frames);
+        writer.dither = resume.dither;
+    }
+    else
+        openOutput(&writer, output, reader.sampleRate);
+    renderStream(reverb, &reader, &writer, chunk, checkpoint);
+    ReverbLoad load;
+    reverb_get_load(reverb, &load);
+    if (verbose)
+    {
+        fprintf(stdout, "Rendered at %.2f%% average DSP load, %.2f%% peak\n", load.average * 100.0, load.peak * 100.0);
+        fprintf(stdout, "Wrote %ld samples at %d Hz to %s\n", writer.frames, reader.sampleRate, output);
     }
+    long written = writer.frames;
 
-    /* RIFF header fields */
-    char chunkId[5];
-    uint32_t chunkSize;
-    char format[5];
-    char subchunk1Id[5];
-    uint32_t subchunk1Size;
-    uint16_t audioFormat;
-    uint16_t numChannels;
-    uint32_t sampleRate_;
-    uint32_t byteRate;
-    uint16_t blockAlign;
-    uint16_t bitsPerSample;
-    char subchunk2Id[5];
-    uint32_t subchunk2Size;
-
-    fread(chunkId, 1, 4, fp);
-    fread(&chunkSize, 4, 1, fp);
-    fread(format, 1, 4, fp);
-
-    fread(subchunk1Id, 1, 4, fp);
-    fread(&subchunk1Size, 4, 1, fp);
-    fread(&audioFormat, 2, 1, fp);
-    fread(&numChannels, 2, 1, fp);
-    fread(&sampleRate_, 4, 1, fp);
-    fread(&byteRate, 4, 1, fp);
-    fread(&blockAlign, 2, 1, fp);
-    fread(&bitsPerSample, 2, 1, fp);
-
-    fread(subchunk2Id, 1, 4, fp);
-    fread(&subchunk2Size, 4, 1, fp);
-
-    // verify header
-    if (strncmp(chunkId, "RIFF", 4) != 0 ||
-        strncmp(format, "WAVE", 4) != 0 ||
-        strncmp(subchunk1Id, "fmt ", 4) != 0 ||
-        audioFormat != 1 || // PCM
-        subchunk1Size != 16 ||
-        numChannels != 2 ||
-        bitsPerSample != 16 ||
-        numSamples == 0 ||
-        strncmp(subchunk2Id, "data", 4) != 0)
-    {
-        fprintf(stderr, "Invalid WAV file. Must be 16 bit stereo PCM audio.\n");
-        fclose(fp);
+    wavCloseWrite(&writer);
+    wavCloseRead(&reader);
+    if (checkpoint)
+        remove(checkpoint);
+    free(checkpoint);
+    free(output);
+    free(chunk);
+    destroy_reverb(reverb);
+    return written;
+}
+
+/* Render a file like renderFile, but reading the input and writing the
+   output in place through memory mappings instead of stdio */
+static int renderMappedFile(const char *filename)
+{
+    WavMap input, output;
+    WavFormat format;
+    float *chunk = (float *)malloc(RENDER_CHUNK_FRAMES * 2 * sizeof(float));
+
+    wavMapRead(&input, filename);
+    if (input.format.channels > 2)
+    {
+        fprintf(stderr, "%s has %d channels; use --multi for more than two.\n", filename, input.format.channels);
         exit(1);
     }
+    fprintf(stdout, "Mapped %ld samples at %d Hz\n", input.frames, input.sampleRate);
+    DattoroReverb *reverb = createReverb(input.sampleRate);
+    set_reverb_param(reverb, REVERB_SIZE, 0.5);
+    set_reverb_param(reverb, REVERB_WET, -6);
 
-    *sampleRate = sampleRate_;
-    *numSamples = subchunk2Size / (numChannels * (bitsPerSample / 8));
-    int16_t *shortSamples = (int16_t *)malloc(subchunk2Size);
-    fread(shortSamples, 1, subchunk2Size, fp);
-    *samples = (float *)malloc(*numSamples * numChannels * sizeof(float));
-    for (int i = 0; i < *numSamples * numChannels; i++)
+    char *outputFile = outputName(filename);
+    wavStereoFormat(&format, input.sampleRate, 16, 0);
+    wavMapWrite(&output, outputFile, &format, input.frames + tailFrames(reverb));
+    for (long offset = 0; offset < output.frames; offset += RENDER_CHUNK_FRAMES)
     {
-        (*samples)[i] = shortSamples[i] / 32768.0f;
+        int frames = output.frames - offset < RENDER_CHUNK_FRAMES ? output.frames - offset : RENDER_CHUNK_FRAMES;
+        // the input runs out partway through a chunk; the rest is tail
+        int inputFrames = input.frames - offset;
+        inputFrames = inputFrames < 0 ? 0 : inputFrames > frames ? frames : inputFrames;
+        wavMapGetFrames(&input, offset, chunk, inputFrames);
+        memset(chunk + inputFrames * 2, 0, (frames - inputFrames) * 2 * sizeof(float));
+        stereo_reverb_buffer(reverb, chunk, frames * 2);
+        wavMapPutFrames(&output, offset, chunk, frames);
     }
-    free(shortSamples);
+    fprintf(stdout, "Wrote %ld samples at %d Hz to %s\n", output.frames, input.sampleRate, outputFile);
 
-    fclose(fp);
+    wavUnmap(&output);
+    wavUnmap(&input);
+    free(outputFile);
+    free(chunk);
+    destroy_reverb(reverb);
+    return 0;
 }
 
-int main(int argc, char **argv)
+/* Layouts of --surround, in the order of enum reverb_layout */
+static const char *layoutNames[REVERB_LAYOUT_MAX] = {"stereo", "5.1", "7.1", "foa"};
+
+/* Render a stereo file into a multichannel file of reverb only (no dry
+   signal), with one output per channel of the layout, followed by its tail */
+static int renderSurround(const char *layoutName, const char *filename)
 {
-    // check for input file
-    if (argc < 2)
+    WavReader reader;
+    WavWriter writer;
+    WavFormat format;
+    int layout;
+    int frames;
+
+    for (layout = 0; layout < REVERB_LAYOUT_MAX; layout++)
+        if (strcmp(layoutName, layoutNames[layout]) == 0)
+            break;
+    if (layout == REVERB_LAYOUT_MAX)
     {
-        fprintf(stderr, "Usage: %s <input.wav>\n", argv[0]);
+        fprintf(stderr, "Unknown layout %s. Use stereo, 5.1, 7.1 or foa.\n", layoutName);
         return 1;
     }
-    // read it
-    int sampleRate;
-    int nSamples;
-    float *samples;
-    readWavStereo16(argv[1], &samples, &nSamples, &sampleRate);
-    fprintf(stdout, "Read %d samples at %d Hz\n", nSamples, sampleRate);
-    // construct and configure reverb
-    DattoroReverb *reverb = create_reverb(sampleRate);
+    if (!wavOpenRead(&reader, filename))
+        return 1;
+    DattoroReverb *reverb = createReverb(reader.sampleRate);
     set_reverb_param(reverb, REVERB_SIZE, 0.5);
     set_reverb_param(reverb, REVERB_WET, -6);
-    // render reverb
-    int reverbSamples = nSamples + 10 * sampleRate;
-    float *reverbBuffer = (float *)malloc(reverbSamples * 2 * sizeof(float));
-    memset(reverbBuffer, 0, reverbSamples * 2 * sizeof(float));
-    memcpy(reverbBuffer, samples, nSamples * 2 * sizeof(float));
-    stereo_reverb_buffer(reverb, reverbBuffer, reverbSamples);
-    // write it
-    char *suffix = "_reverb.wav";
-    char *output = (char *)malloc(strlen(argv[1]) + strlen(suffix) + 1);    
-    strcpy(output, argv[1]);
-    strcat(output, suffix);
-    fprintf(stdout, "Writing %d samples at %d Hz to %s\n", reverbSamples, sampleRate, output);
-    writeWavStereo16(output, reverbBuffer, reverbSamples, sampleRate);
-    // free everything
+    reverb_set_layout(reverb, layout);
+
+    int channels = reverb->n_outputs;
+    float *chunk = (float *)malloc(RENDER_CHUNK_FRAMES * 2 * sizeof(float));
+    float *output = (float *)malloc(RENDER_CHUNK_FRAMES * channels * sizeof(float));
+    char *outputFile = outputName(filename);
+    wavPcmFormat(&format, reader.sampleRate, channels, outputBits, outputFloat);
+    wavOpenWrite(&writer, outputFile, &format, outputDither);
+    while ((frames = wavReadFrames(&reader, chunk, RENDER_CHUNK_FRAMES)) > 0)
+    {
+        multi_reverb_buffer(reverb, chunk, output, frames);
+        wavWriteFrames(&writer, output, frames);
+    }
+    memset(chunk, 0, RENDER_CHUNK_FRAMES * 2 * sizeof(float));
+    for (long left = tailFrames(reverb); left > 0; left -= frames)
+    {
+        frames = left < RENDER_CHUNK_FRAMES ? left : RENDER_CHUNK_FRAMES;
+        multi_reverb_buffer(reverb, chunk, output, frames);
+        wavWriteFrames(&writer, output, frames);
+    }
+    fprintf(stdout, "Wrote %ld samples of %d channels (%s) at %d Hz to %s\n", writer.frames, channels,
+            layoutNames[layout], reader.sampleRate, outputFile);
+
+    wavCloseWrite(&writer);
+    wavCloseRead(&reader);
+    free(outputFile);
     free(output);
-    free(samples);
-    free(reverbBuffer);
+    free(chunk);
     destroy_reverb(reverb);
+    return 0;
+}
+
+/* Check a change of layout during a quality crossfade: for every layout and
+   tier, render noise in one layout, switch tier, change layout part way
+   through the crossfade, and require every output of the rest of the
+   crossfade and after it to be finite and well inside the level a wrong
+   network would reach. Returns nonzero if any fail */
+static int crossfadeCheck(void)
+{
+    const int sampleRate = 48000;
+    const int blockFrames = 256;
+    const float limit = 8.0f;
+    float *input = (float *)malloc(blockFrames * 2 * sizeof(float));
+    float *output = (float *)malloc(blockFrames * REVERB_MAX_OUTPUTS * sizeof(float));
+    int failures = 0;
+    uint32_t seed = 1;
+
+    for (int i = 0; i < blockFrames * 2; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        input[i] = (int32_t)seed * (0.25f / 2147483648.0f);
+    }
+    for (int from = 0; from < REVERB_LAYOUT_MAX; from++)
+        for (int to = 0; to < REVERB_LAYOUT_MAX; to++)
+            for (int q = REVERB_QUALITY_NO_MODULATION; q < REVERB_QUALITY_MAX; q++)
+            {
+                DattoroReverb *reverb = create_reverb(sampleRate);
+                float peak = 0.0f;
+                bool finite = true;
+
+                reverb_set_layout(reverb, from);
+                for (int b = 0; b < 50; b++)
+                    multi_reverb_buffer(reverb, input, output, blockFrames);
+                reverb_set_quality(reverb, q);
+                multi_reverb_buffer(reverb, input, output, blockFrames);
+                reverb_set_layout(reverb, to);
+                for (int b = 0; b < 50; b++)
+                {
+                    multi_reverb_buffer(reverb, input, output, blockFrames);
+                    for (int i = 0; i < blockFrames * reverb->n_outputs; i++)
+                    {
+                        finite = finite && isfinite(output[i]);
+                        peak = fmaxf(peak, fabsf(output[i]));
+                    }
+                }
+                if (!finite || !(peak <= limit))
+                {
+                    fprintf(stderr, "Layout %s to %s while crossfading to %s: %s, peak %g\n", layoutNames[from],
+                            layoutNames[to], qualityNames[q], finite ? "finite" : "not finite", peak);
+                    failures++;
+                }
+                destroy_reverb(reverb);
+            }
+    fprintf(stdout, "%d of %d layout changes during a crossfade failed\n", failures,
+            REVERB_LAYOUT_MAX * REVERB_LAYOUT_MAX * (REVERB_QUALITY_MAX - 1));
+    free(output);
+    free(input);
+    return failures > 0;
+}
+
+/* A channel pair (or single channel) of a multichannel file, with its own reverb */
+typedef struct MultiGroup
+{
+    int channel;
+    int channels;
+    DattoroReverb *reverb;
+    float *samples; // MULTI_BLOCK_FRAMES frames, interleaved if a pair
+} MultiGroup;
+
+typedef struct Multi Multi;
+
+/* A thread of a multichannel render, with a tile of every channel to
+   de/interleave through */
+typedef struct MultiWorker
+{
+    Multi *multi;
+    int index;
+    float *tile;
+    WavDither dither;
+    pthread_t thread;
+} MultiWorker;
+
+struct Multi
+{
+    WavMap input, output;
+    MultiGroup *groups;
+    int nGroups;
+    MultiWorker *workers;
+    int nWorkers;
+    pthread_barrier_t barrier;
+};
+
+/* Render blocks of a multichannel file in three steps, with every worker
+   between barriers. Each worker first converts its share of the block's frames
+   from the input mapping a tile at a time and deinterleaves them into the
+   groups, then runs the reverbs of its share of the groups over the block,
+   then interleaves its frames back from the groups into the output mapping */
+static void *multiWorker(void *arg)
+{
+    MultiWorker *worker = (MultiWorker *)arg;
+    Multi *multi = worker->multi;
+    int nChannels = multi->input.format.channels;
+
+    for (long offset = 0; offset < multi->output.frames; offset += MULTI_BLOCK_FRAMES)
+    {
+        int frames = multi->output.frames - offset < MULTI_BLOCK_FRAMES ? multi->output.frames - offset : MULTI_BLOCK_FRAMES;
+        int first = (long)frames * worker->index / multi->nWorkers;
+        int last = (long)frames * (worker->index + 1) / multi->nWorkers;
+
+        for (int t = first; t < last; t += MULTI_TILE_FRAMES)
+        {
+            int n = last - t < MULTI_TILE_FRAMES ? last - t : MULTI_TILE_FRAMES;
+            // the input runs out partway through a tile; the rest is tail
+            long inputFrames = multi->input.frames - (offset + t);
+            inputFrames = inputFrames < 0 ? 0 : inputFrames > n ? n : inputFrames;
+            wavToFloat(&multi->input.format, multi->input.data + (offset + t) * multi->input.format.blockAlign,
+                       worker->tile, inputFrames);
+            memset(worker->tile + inputFrames * nChannels, 0, (n - inputFrames) * nChannels * sizeof(float));
+            for (int g = 0; g < multi->nGroups; g++)
+            {
+                MultiGroup *group = &multi->groups[g];
+                const float *src = worker->tile + group->channel;
+                float *dst = group->samples + t * group->channels;
+                for (int f = 0; f < n; f++, src += nChannels, dst += group->channels)
+                {
+                    dst[0] = src[0];
+                    if (group->channels == 2)
+                        dst[1] = src[1];
+                }
+            }
+        }
+        pthread_barrier_wait(&multi->barrier);
+
+        for (int g = worker->index; g < multi->nGroups; g += multi->nWorkers)
+        {
+            MultiGroup *group = &multi->groups[g];
+            if (group->channels == 2)
+                stereo_reverb_buffer(group->reverb, group->samples, frames * 2);
+            else
+                mono_reverb_buffer(group->reverb, group->samples, frames);
+        }
+        pthread_barrier_wait(&multi->barrier);
+
+        for (int t = first; t < last; t += MULTI_TILE_FRAMES)
+        {
+            int n = last - t < MULTI_TILE_FRAMES ? last - t : MULTI_TILE_FRAMES;
+            for (int g = 0; g < multi->nGroups; g++)
+            {
+                MultiGroup *group = &multi->groups[g];
+                const float *src = group->samples + t * group->channels;
+                float *dst = worker->tile + group->channel;
+                for (int f = 0; f < n; f++, src += group->channels, dst += nChannels)
+                {
+                    dst[0] = src[0];
+                    if (group->channels == 2)
+                        dst[1] = src[1];
+                }
+            }
+            wavFromFloat(&multi->output.format, worker->tile,
+                         multi->output.data + (offset + t) * multi->output.format.blockAlign, n,
+                         outputDither ? &worker->dither : NULL);
+        }
+        // the groups are refilled for the next block only once every worker is done with them
+        pthread_barrier_wait(&multi->barrier);
+    }
+    return NULL;
+}
+
+/* Render a file of any number of channels through memory mappings, with an
+   independent reverb for each channel pair (or each channel, with --mono; an
+   odd last channel is always alone). Arguments are [-j threads] [--mono] and
+   the file name; the groups are shared between one thread per core by default */
+static int renderMultichannel(int argc, char **argv)
+{
+    Multi multi;
+    WavFormat format;
+    const char *filename = NULL;
+    int mono = 0, nChannels;
+    double start;
+
+    multi.nWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            multi.nWorkers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--mono") == 0)
+            mono = 1;
+        else
+            filename = argv[i];
+    }
+    if (!filename)
+    {
+        fprintf(stderr, "No input file.\n");
+        return 1;
+    }
+
+    wavMapRead(&multi.input, filename);
+    nChannels = multi.input.format.channels;
+    multi.nGroups = mono ? nChannels : (nChannels + 1) / 2;
+    multi.groups = (MultiGroup *)malloc(multi.nGroups * sizeof(*multi.groups));
+    for (int g = 0; g < multi.nGroups; g++)
+    {
+        MultiGroup *group = &multi.groups[g];
+        group->channel = mono ? g : g * 2;
+        group->channels = mono || group->channel + 1 == nChannels ? 1 : 2;
+        group->reverb = createReverb(multi.input.sampleRate);
+        set_reverb_param(group->reverb, REVERB_SIZE, 0.5);
+        set_reverb_param(group->reverb, REVERB_WET, -6);
+        group->samples = (float *)malloc(MULTI_BLOCK_FRAMES * group->channels * sizeof(float));
+    }
+    if (multi.nWorkers < 1 || multi.nWorkers > multi.nGroups)
+        multi.nWorkers = multi.nGroups;
+    fprintf(stdout, "Mapped %ld samples of %d channels at %d Hz; %d reverbs on %d threads\n", multi.input.frames,
+            nChannels, multi.input.sampleRate, multi.nGroups, multi.nWorkers);
+
+    char *output = outputName(filename);
+    wavPcmFormat(&format, multi.input.sampleRate, nChannels, outputBits, outputFloat);
+    wavMapWrite(&multi.output, output, &format, multi.input.frames + tailFrames(multi.groups[0].reverb));
+
+    start = nowNs();
+    pthread_barrier_init(&multi.barrier, NULL, multi.nWorkers);
+    multi.workers = (MultiWorker *)malloc(multi.nWorkers * sizeof(*multi.workers));
+    for (int i = 0; i < multi.nWorkers; i++)
+    {
+        MultiWorker *worker = &multi.workers[i];
+        worker->multi = &multi;
+        worker->index = i;
+        worker->tile = (float *)malloc(MULTI_TILE_FRAMES * nChannels * sizeof(float));
+        wavDitherInit(&worker->dither, i + 1);
+        pthread_create(&worker->thread, NULL, multiWorker, worker);
+    }
+    for (int i = 0; i < multi.nWorkers; i++)
+    {
+        pthread_join(multi.workers[i].thread, NULL);
+        free(multi.workers[i].tile);
+    }
+    double seconds = (nowNs() - start) / 1e9;
+    fprintf(stdout, "Wrote %ld samples of %d channels to %s in %.3f s (%.1fx real time)\n", multi.output.frames,
+            nChannels, output, seconds, multi.output.frames / (double)multi.input.sampleRate / seconds);
+
+    pthread_barrier_destroy(&multi.barrier);
+    wavUnmap(&multi.output);
+    wavUnmap(&multi.input);
+    for (int g = 0; g < multi.nGroups; g++)
+    {
+        destroy_reverb(multi.groups[g].reverb);
+        free(multi.groups[g].samples);
+    }
+    free(multi.groups);
+    free(multi.workers);
+    free(output);
+    return 0;
+}
+
+/* Read until bytes have been read or the input ends, as pipes deliver data in
+   pieces. Returns the number of bytes read */
+static size_t readFull(int fd, unsigned char *buf, size_t bytes)
+{
+    size_t done = 0;
+    while (done < bytes)
+    {
+        ssize_t n = read(fd, buf + done, bytes - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            fprintf(stderr, "Read failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/* Write all of bytes, however many calls it takes */
+static void writeFull(int fd, const unsigned char *buf, size_t bytes)
+{
+    while (bytes > 0)
+    {
+        ssize_t n = write(fd, buf, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            // the reader went away, as when piped into head
+            if (errno == EPIPE)
+                exit(0);
+            fprintf(stderr, "Write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        buf += n;
+        bytes -= n;
+    }
+}
+
+/* Filter raw interleaved PCM from stdin to stdout, for use in shell pipelines.
+   Arguments are [-f s16|s24|f32] [-r rate] [-c channels] [-b block_frames].
+   Input is read and output written a whole block at a time with read and
+   write, with no stdio buffering in between; the output is stereo in the
+   format chosen with --format, followed by the tail once the input ends */
+static int renderRaw(int argc, char **argv)
+{
+    const char *inputFormat = "s16";
+    int sampleRate = 48000, channels = 2, blockFrames = 16384;
+    WavFormat in, out;
+    WavDither dither;
+    TailGate tail;
+    int frames;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            inputFormat = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            sampleRate = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            channels = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            blockFrames = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Unknown raw option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if ((strcmp(inputFormat, "s16") != 0 && strcmp(inputFormat, "s24") != 0 && strcmp(inputFormat, "f32") != 0) ||
+        channels < 1 || channels > 2 || sampleRate <= 0 || blockFrames <= 0)
+    {
+        fprintf(stderr, "Raw input must be s16, s24 or f32, mono or stereo, at a positive rate and block size.\n");
+        return 1;
+    }
+    wavPcmFormat(&in, sampleRate, channels, atoi(inputFormat + 1), inputFormat[0] == 'f');
+    wavStereoFormat(&out, sampleRate, outputBits, outputFloat);
+    wavDitherInit(&dither, 1);
+
+    unsigned char *inBuf = (unsigned char *)malloc((size_t)blockFrames * in.blockAlign);
+    unsigned char *outBuf = (unsigned char *)malloc((size_t)blockFrames * out.blockAlign);
+    float *chunk = (float *)malloc((size_t)blockFrames * 2 * sizeof(float));
+    DattoroReverb *reverb = createReverb(sampleRate);
+    set_reverb_param(reverb, REVERB_SIZE, 0.5);
+    set_reverb_param(reverb, REVERB_WET, -6);
+
+    // a partial frame at the very end is dropped
+    while ((frames = readFull(STDIN_FILENO, inBuf, (size_t)blockFrames * in.blockAlign) / in.blockAlign) > 0)
+    {
+        wavToFloatStereo(&in, inBuf, chunk, frames);
+        stereo_reverb_buffer(reverb, chunk, frames * 2);
+        wavFromFloat(&out, chunk, outBuf, frames, outputDither ? &dither : NULL);
+        writeFull(STDOUT_FILENO, outBuf, (size_t)frames * out.blockAlign);
+    }
+    tailStart(&tail, reverb);
+    while ((frames = tailNext(&tail, reverb, chunk, blockFrames)) > 0)
+    {
+        wavFromFloat(&out, chunk, outBuf, frames, outputDither ? &dither : NULL);
+        writeFull(STDOUT_FILENO, outBuf, (size_t)frames * out.blockAlign);
+    }
+
+    destroy_reverb(reverb);
+    free(chunk);
+    free(outBuf);
+    free(inBuf);
+    return 0;
+}
+
+/* A chunk of audio passed between the pipeline stages */
+typedef struct PipelineChunk
+{
+    float *samples;
+    int frames;
+    int last;
+} PipelineChunk;
+
+/* Lock-free single producer, single consumer ring of chunk pointers */
+typedef struct SpscRing
+{
+    _Alignas(64) atomic_uint head; /* next slot to pop, written by the consumer */
+    _Alignas(64) atomic_uint tail; /* next slot to push, written by the producer */
+    PipelineChunk *slots[PIPELINE_CHUNKS];
+} SpscRing;
+
+static void ringInit(SpscRing *ring)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+/* Push a chunk; never blocks, as the rings hold as many slots as there are chunks */
+static void ringPush(SpscRing *ring, PipelineChunk *chunk)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->slots[tail & (PIPELINE_CHUNKS - 1)] = chunk;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* Pop a chunk, spinning until one is available */
+static PipelineChunk *ringPop(SpscRing *ring)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head)
+        sched_yield();
+    PipelineChunk *chunk = ring->slots[head & (PIPELINE_CHUNKS - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return chunk;
+}
+
+/* Reader -> DSP -> writer pipeline; chunks return to the reader through freeChunks */
+typedef struct Pipeline
+{
+    SpscRing freeChunks;
+    SpscRing readChunks;
+    SpscRing doneChunks;
+    PipelineChunk chunks[PIPELINE_CHUNKS];
+    WavReader reader;
+    WavWriter writer;
+    DattoroReverb *reverb;
+    long tailFrames;
+} Pipeline;
+
+/* Reader stage: fill free chunks from the file, then with the silent tail */
+static void *pipelineReader(void *arg)
+{
+    Pipeline *pipeline = (Pipeline *)arg;
+    long tail = pipeline->tailFrames;
+    PipelineChunk *chunk;
+
+    do
+    {
+        chunk = ringPop(&pipeline->freeChunks);
+        chunk->frames = wavReadFrames(&pipeline->reader, chunk->samples, RENDER_CHUNK_FRAMES);
+        if (chunk->frames == 0)
+        {
+            chunk->frames = tail < RENDER_CHUNK_FRAMES ? tail : RENDER_CHUNK_FRAMES;
+            memset(chunk->samples, 0, chunk->frames * 2 * sizeof(float));
+            tail -= chunk->frames;
+        }
+        chunk->last = (tail == 0);
+        ringPush(&pipeline->readChunks, chunk);
+    } while (!chunk->last);
+    return NULL;
+}
+
+/* DSP stage: run the reverb over each chunk */
+static void *pipelineDsp(void *arg)
+{
+    Pipeline *pipeline = (Pipeline *)arg;
+    PipelineChunk *chunk;
+
+    do
+    {
+        chunk = ringPop(&pipeline->readChunks);
+        stereo_reverb_buffer(pipeline->reverb, chunk->samples, chunk->frames * 2);
+        ringPush(&pipeline->doneChunks, chunk);
+    } while (!chunk->last);
+    return NULL;
+}
+
+/* Render a file like renderFile, with reading, processing and writing
+   overlapped on three threads connected by lock-free rings */
+static int renderPipelinedFile(const char *filename)
+{
+    Pipeline *pipeline = (Pipeline *)malloc(sizeof(*pipeline));
+    pthread_t readerThread, dspThread;
+    PipelineChunk *chunk;
+
+    ringInit(&pipeline->freeChunks);
+    ringInit(&pipeline->readChunks);
+    ringInit(&pipeline->doneChunks);
+    for (int i = 0; i < PIPELINE_CHUNKS; i++)
+    {
+        pipeline->chunks[i].samples = (float *)malloc(RENDER_CHUNK_FRAMES * 2 * sizeof(float));
+        ringPush(&pipeline->freeChunks, &pipeline->chunks[i]);
+    }
+
+    if (!wavOpenRead(&pipeline->reader, filename))
+        exit(1);
+    fprintf(stdout, "Reading %ld samples at %d Hz\n", pipeline->reader.framesLeft, pipeline->reader.sampleRate);
+    pipeline->reverb = createReverb(pipeline->reader.sampleRate);
+    set_reverb_param(pipeline->reverb, REVERB_SIZE, 0.5);
+    set_reverb_param(pipeline->reverb, REVERB_WET, -6);
+    reverb_enable_load_meter(pipeline->reverb, true);
+    pipeline->tailFrames = tailFrames(pipeline->reverb);
+    char *output = outputName(filename);
+    openOutput(&pipeline->writer, output, pipeline->reader.sampleRate);
+
+    pthread_create(&readerThread, NULL, pipelineReader, pipeline);
+    pthread_create(&dspThread, NULL, pipelineDsp, pipeline);
+
+    // this thread is the writer stage
+    do
+    {
+        chunk = ringPop(&pipeline->doneChunks);
+        wavWriteFrames(&pipeline->writer, chunk->samples, chunk->frames);
+        ringPush(&pipeline->freeChunks, chunk);
+    } while (!chunk->last);
+
+    pthread_join(readerThread, NULL);
+    pthread_join(dspThread, NULL);
+    ReverbLoad load;
+    reverb_get_load(pipeline->reverb, &load);
+    fprintf(stdout, "Rendered at %.2f%% average DSP load, %.2f%% peak\n", load.average * 100.0, load.peak * 100.0);
+    fprintf(stdout, "Wrote %ld samples at %d Hz to %s\n", pipeline->writer.frames, pipeline->reader.sampleRate, output);
+
+    wavCloseWrite(&pipeline->writer);
+    wavCloseRead(&pipeline->reader);
+    for (int i = 0; i < PIPELINE_CHUNKS; i++)
+        free(pipeline->chunks[i].samples);
+    destroy_reverb(pipeline->reverb);
+    free(output);
+    free(pipeline);
+    return 0;
+}
+
+/* A file being rendered by renderFilesAsync */
+typedef struct AsyncFile
+{
+    int inFd, outFd;
+    WavFormat format;
+    DattoroReverb *reverb;
+    long inputFrames;
+    long totalFrames;
+    long issuedFrames;
+    long processedFrames;
+    int pendingWrites;
+} AsyncFile;
+
+#define SLOT_FREE 0
+#define SLOT_READING 1
+#define SLOT_READY 2
+#define SLOT_WRITING 3
+
+/* A chunk buffer, which is read into, processed in place and written back out.
+   It is sized for the widest input format (stereo 32 bit) */
+typedef struct AsyncSlot
+{
+    unsigned char *data;
+    AsyncFile *file;
+    long offset;
+    int frames;
+    int inputFrames;
+    int state;
+} AsyncSlot;
+
+/* Open an input file, create its reverb, and create its output with the header
+   already written */
+static void openAsyncFile(AsyncFile *file, const char *filename)
+{
+    unsigned char header[WAV_HEADER_BYTES];
+    WavFormat format;
+
+    file->inFd = open(filename, O_RDONLY);
+    if (file->inFd < 0)
+    {
+        fprintf(stderr, "Cannot open %s for reading.\n", filename);
+        exit(1);
+    }
+    if (!wavReadFormat(file->inFd, &file->format) || file->format.channels > 2)
+    {
+        fprintf(stderr, "Unsupported WAV file %s. Must be mono or stereo 16, 24 or 32 bit PCM or 32 bit float audio.\n", filename);
+        exit(1);
+    }
+    file->reverb = createReverb(file->format.sampleRate);
+    set_reverb_param(file->reverb, REVERB_SIZE, 0.5);
+    set_reverb_param(file->reverb, REVERB_WET, -6);
+    file->inputFrames = file->format.frames;
+    file->totalFrames = file->inputFrames + tailFrames(file->reverb);
+    file->issuedFrames = 0;
+    file->processedFrames = 0;
+    file->pendingWrites = 0;
+
+    char *output = outputName(filename);
+    file->outFd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    wavStereoFormat(&format, file->format.sampleRate, 16, 0);
+    if (!wavFitsFrames(&format, file->totalFrames))
+    {
+        fprintf(stderr, "%s would be too long for a WAV file.\n", output);
+        exit(1);
+    }
+    wavFormatHeader(header, file->totalFrames * 2 * sizeof(int16_t), &format);
+    if (file->outFd < 0 || pwrite(file->outFd, header, WAV_HEADER_BYTES, 0) != WAV_HEADER_BYTES)
+    {
+        fprintf(stderr, "Cannot open %s for writing.\n", output);
+        exit(1);
+    }
+    free(output);
+}
+
+/* Render many files like renderFile, keeping up to ASYNC_DEPTH chunk reads and
+   writes in flight across files through the given I/O backend while the reverb
+   processes chunks in order. Returns the number of frames written */
+static long renderFilesAsync(int nFiles, char **filenames, int backend, int verbose)
+{
+    AsyncIO io;
+    AsyncSlot slots[ASYNC_DEPTH];
+    AsyncFile *files = (AsyncFile *)calloc(nFiles, sizeof(*files));
+    float *chunk = (float *)malloc(RENDER_CHUNK_FRAMES * 2 * sizeof(float));
+    long issueSeq = 0, dspSeq = 0, written = 0;
+    int issueFile = 0;
+    AsyncCompletion completion;
+
+    asyncInit(&io, ASYNC_DEPTH, backend);
+    if (verbose)
+        fprintf(stdout, "Rendering %d files with %s, %d requests in flight\n", nFiles, asyncBackendName(&io), ASYNC_DEPTH);
+    for (int i = 0; i < ASYNC_DEPTH; i++)
+    {
+        slots[i].data = (unsigned char *)malloc(RENDER_CHUNK_FRAMES * 2 * sizeof(int32_t));
+        slots[i].state = SLOT_FREE;
+    }
+
+    for (;;)
+    {
+        // start reading the next chunks, moving on to the next file as each runs out
+        while (issueFile < nFiles && slots[issueSeq % ASYNC_DEPTH].state == SLOT_FREE)
+        {
+            AsyncSlot *slot = &slots[issueSeq % ASYNC_DEPTH];
+            AsyncFile *file = &files[issueFile];
+            if (file->issuedFrames == 0)
+                openAsyncFile(file, filenames[issueFile]);
+            slot->file = file;
+            slot->offset = file->issuedFrames;
+            slot->frames = file->totalFrames - slot->offset < RENDER_CHUNK_FRAMES ? file->totalFrames - slot->offset : RENDER_CHUNK_FRAMES;
+            slot->inputFrames = file->inputFrames - slot->offset < slot->frames ? file->inputFrames - slot->offset : slot->frames;
+            if (slot->inputFrames < 0)
+                slot->inputFrames = 0;
+            file->issuedFrames += slot->frames;
+            if (file->issuedFrames == file->totalFrames)
+                issueFile++;
+            // chunks of pure tail need nothing read
+            if (slot->inputFrames > 0)
+            {
+                slot->state = SLOT_READING;
+                asyncRead(&io, file->inFd, slot->data, slot->inputFrames * file->format.blockAlign,
+                          file->format.dataOffset + slot->offset * file->format.blockAlign, slot);
+            }
+            else
+                slot->state = SLOT_READY;
+            issueSeq++;
+        }
+
+        // process every chunk that has arrived, in order, and start writing it
+        while (dspSeq < issueSeq && slots[dspSeq % ASYNC_DEPTH].state == SLOT_READY)
+        {
+            AsyncSlot *slot = &slots[dspSeq % ASYNC_DEPTH];
+            wavToFloatStereo(&slot->file->format, slot->data, chunk, slot->inputFrames);
+            memset(chunk + slot->inputFrames * 2, 0, (slot->frames - slot->inputFrames) * 2 * sizeof(float));
+            stereo_reverb_buffer(slot->file->reverb, chunk, slot->frames * 2);
+            wavFloatToShort(chunk, (int16_t *)slot->data, slot->frames * 2);
+            slot->state = SLOT_WRITING;
+            slot->file->processedFrames += slot->frames;
+            slot->file->pendingWrites++;
+            asyncWrite(&io, slot->file->outFd, slot->data, slot->frames * 2 * sizeof(int16_t),
+                       WAV_HEADER_BYTES + slot->offset * 2 * sizeof(int16_t), slot);
+            dspSeq++;
+        }
+
+        if (!asyncWait(&io, &completion))
+            break;
+        AsyncSlot *slot = (AsyncSlot *)completion.user;
+        long expected = slot->state == SLOT_READING ? slot->inputFrames * slot->file->format.blockAlign
+                                                    : slot->frames * 2 * (long)sizeof(int16_t);
+        if (completion.result != expected)
+        {
+            fprintf(stderr, "%s failed: %s\n", slot->state == SLOT_READING ? "Read" : "Write",
+                    completion.result < 0 ? strerror(-completion.result) : "short transfer");
+            exit(1);
+        }
+        if (slot->state == SLOT_READING)
+            slot->state = SLOT_READY;
+        else
+        {
+            slot->state = SLOT_FREE;
+            written += slot->frames;
+            if (--slot->file->pendingWrites == 0 && slot->file->processedFrames == slot->file->totalFrames)
+            {
+                close(slot->file->inFd);
+                close(slot->file->outFd);
+                destroy_reverb(slot->file->reverb);
+            }
+        }
+    }
+
+    if (verbose)
+        fprintf(stdout, "Wrote %ld samples\n", written);
+    for (int i = 0; i < ASYNC_DEPTH; i++)
+        free(slots[i].data);
+    asyncClose(&io);
+    free(chunk);
+    free(files);
+    return written;
+}
+
+/* Compare rendering many files with stdio against the asynchronous backends */
+static int ioBenchmark(int nFiles, char **filenames)
+{
+    const int backends[] = {ASYNC_IO_URING, ASYNC_IO_SYNC};
+    double start, seconds;
+    long frames = 0;
+
+    start = nowNs();
+    for (int i = 0; i < nFiles; i++)
+        frames += renderFile(filenames[i], 0);
+    seconds = (nowNs() - start) / 1e9;
+    fprintf(stdout, "%-14s %8.3f s %8.1f MB/s\n", "stdio", seconds, frames * 4 / seconds / 1e6);
+
+    for (int b = 0; b < 2; b++)
+    {
+        AsyncIO io;
+        asyncInit(&io, 1, backends[b]);
+        const char *name = asyncBackendName(&io);
+        int available = io.backend == backends[b];
+        asyncClose(&io);
+        if (!available)
+        {
+            fprintf(stdout, "%-14s unavailable\n", "io_uring");
+            continue;
+        }
+        start = nowNs();
+        frames = renderFilesAsync(nFiles, filenames, backends[b], 0);
+        seconds = (nowNs() - start) / 1e9;
+        fprintf(stdout, "%-14s %8.3f s %8.1f MB/s\n", name, seconds, frames * 4 / seconds / 1e6);
+    }
+    fprintf(stdout, "%d files; MB/s counts 16 bit stereo output\n", nFiles);
+    return 0;
+}
+
+/* A named set of reverb parameters for batch rendering */
+typedef struct ReverbPreset
+{
+    const char *name;
+    double size;
+    double decay;
+    double damping;
+    double predelay;
+    double wet;
+} ReverbPreset;
+
+static const ReverbPreset presets[] = {
+    {"default", 0.5, 0.7, 0.05, 0.001, -6.0},
+    {"room", 0.3, 0.5, 0.2, 0.005, -9.0},
+    {"plate", 0.6, 0.75, 0.02, 0.0, -6.0},
+    {"hall", 1.0, 0.85, 0.1, 0.02, -6.0},
+    {"cathedral", 2.0, 0.93, 0.15, 0.04, -4.0},
+};
+
+static const ReverbPreset *findPreset(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(presets) / sizeof(presets[0])); i++)
+        if (strcmp(presets[i].name, name) == 0)
+            return &presets[i];
+    fprintf(stderr, "Unknown preset %s. Presets are:", name);
+    for (int i = 0; i < (int)(sizeof(presets) / sizeof(presets[0])); i++)
+        fprintf(stderr, " %s", presets[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void applyPreset(DattoroReverb *reverb, const ReverbPreset *preset)
+{
+    set_default_reverb(reverb);
+    set_reverb_param(reverb, REVERB_SIZE, preset->size);
+    set_reverb_param(reverb, REVERB_DECAY, preset->decay);
+    set_reverb_param(reverb, REVERB_DAMPING, preset->damping);
+    set_reverb_param(reverb, REVERB_PREDELAY, preset->predelay);
+    set_reverb_param(reverb, REVERB_WET, preset->wet);
+}
+
+/* One file of a batch */
+typedef struct BatchTask
+{
+    char *filename;
+    const ReverbPreset *preset;
+} BatchTask;
+
+/* A worker's share of the batch: the task indices [head, tail), packed into
+   one word so the owner (taking from the head) and thieves (taking from the
+   tail) can both claim tasks with a single compare-and-swap */
+typedef struct BatchQueue
+{
+    _Alignas(64) _Atomic uint64_t range;
+} BatchQueue;
+
+typedef struct BatchWorker
+{
+    pthread_t thread;
+    int index;
+    struct Batch *batch;
+    long files;
+    long skipped;
+    long inputFrames;
+    long outputFrames;
+    long steals;
+} BatchWorker;
+
+typedef struct Batch
+{
+    BatchTask *tasks;
+    int nTasks;
+    BatchQueue *queues;
+    BatchWorker *workers;
+    int nWorkers;
+} Batch;
+
+#define RANGE(head, tail) (((uint64_t)(tail) << 32) | (uint32_t)(head))
+#define RANGE_HEAD(range) ((int)(uint32_t)(range))
+#define RANGE_TAIL(range) ((int)((range) >> 32))
+
+/* Claim the next task from the head of a queue, or -1 if it is empty */
+static int takeTask(BatchQueue *queue)
+{
+    uint64_t range = atomic_load(&queue->range);
+    while (RANGE_HEAD(range) < RANGE_TAIL(range))
+    {
+        if (atomic_compare_exchange_weak(&queue->range, &range, RANGE(RANGE_HEAD(range) + 1, RANGE_TAIL(range))))
+            return RANGE_HEAD(range);
+    }
+    return -1;
+}
+
+/* Steal the last task from the tail of a queue, or -1 if it is empty */
+static int stealTask(BatchQueue *queue)
+{
+    uint64_t range = atomic_load(&queue->range);
+    while (RANGE_HEAD(range) < RANGE_TAIL(range))
+    {
+        if (atomic_compare_exchange_weak(&queue->range, &range, RANGE(RANGE_HEAD(range), RANGE_TAIL(range) - 1)))
+            return RANGE_TAIL(range) - 1;
+    }
+    return -1;
+}
+
+/* Render tasks from this worker's queue, then steal from the others until all are empty.
+   The worker keeps one reverb, cleared and reconfigured for each file */
+static void *batchWorker(void *arg)
+{
+    BatchWorker *worker = (BatchWorker *)arg;
+    Batch *batch = worker->batch;
+    float *chunk = (float *)malloc(RENDER_CHUNK_FRAMES * 2 * sizeof(float));
+    DattoroReverb *reverb = NULL;
+
+    for (;;)
+    {
+        int task = takeTask(&batch->queues[worker->index]);
+        for (int i = 1; task < 0 && i < batch->nWorkers; i++)
+        {
+            task = stealTask(&batch->queues[(worker->index + i) % batch->nWorkers]);
+            if (task >= 0)
+                worker->steals++;
+        }
+        if (task < 0)
+            break;
+
+        WavReader reader;
+        WavWriter writer;
+        // a file that cannot be read is reported and skipped, not the end of the batch
+        if (!wavOpenRead(&reader, batch->tasks[task].filename))
+        {
+            worker->skipped++;
+            continue;
+        }
+        if (reverb && reverb->sample_rate != reader.sampleRate)
+        {
+            destroy_reverb(reverb);
+            reverb = NULL;
+        }
+        if (!reverb)
+            reverb = createReverb(reader.sampleRate);
+        // every file starts from the same state, whichever worker renders it
+        applyPreset(reverb, batch->tasks[task].preset);
+        reverb_reset(reverb);
+
+        char *output = outputName(batch->tasks[task].filename);
+        openOutput(&writer, output, reader.sampleRate);
+        worker->inputFrames += renderStream(reverb, &reader, &writer, chunk, NULL);
+        worker->outputFrames += writer.frames;
+        worker->files++;
+        wavCloseWrite(&writer);
+        wavCloseRead(&reader);
+        free(output);
+    }
+    if (reverb)
+        destroy_reverb(reverb);
+    free(chunk);
+    return NULL;
+}
+
+/* Add a file to the batch, or every .wav file in it if it is a directory */
+static void addBatchPath(Batch *batch, const char *path, const ReverbPreset *preset)
+{
+    struct stat st;
+    const char *suffix = "_reverb.wav";
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(path);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL)
+        {
+            size_t len = strlen(entry->d_name);
+            // skip our own output, so a directory can be rendered again
+            if (len < 4 || strcasecmp(entry->d_name + len - 4, ".wav") != 0 ||
+                (len >= strlen(suffix) && strcmp(entry->d_name + len - strlen(suffix), suffix) == 0))
+                continue;
+            char *file = (char *)malloc(strlen(path) + len + 2);
+            sprintf(file, "%s/%s", path, entry->d_name);
+            addBatchPath(batch, file, preset);
+            free(file);
+        }
+        if (dir)
+            closedir(dir);
+        return;
+    }
+    batch->tasks = (BatchTask *)realloc(batch->tasks, (batch->nTasks + 1) * sizeof(*batch->tasks));
+    batch->tasks[batch->nTasks].filename = strdup(path);
+    batch->tasks[batch->nTasks].preset = preset;
+    batch->nTasks++;
+}
+
+/* Render many files and directories on a work-stealing pool of worker threads.
+   Arguments are [-j threads] and file or directory names, each rendered with the
+   preset of the last [--preset name] before it */
+static int renderBatch(int argc, char **argv)
+{
+    Batch batch = {NULL, 0, NULL, NULL, 0};
+    const ReverbPreset *preset = &presets[0];
+    long files = 0, skipped = 0, inputFrames = 0, outputFrames = 0, steals = 0;
+
+    batch.nWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            batch.nWorkers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--preset") == 0 && i + 1 < argc)
+            preset = findPreset(argv[++i]);
+        else
+            addBatchPath(&batch, argv[i], preset);
+    }
+    if (batch.nWorkers < 1)
+        batch.nWorkers = 1;
+    if (batch.nTasks == 0)
+    {
+        fprintf(stderr, "No files to render.\n");
+        return 1;
+    }
+
+    // deal the files out in contiguous runs; idle workers steal from the end of others' runs
+    batch.queues = (BatchQueue *)calloc(batch.nWorkers, sizeof(*batch.queues));
+    batch.workers = (BatchWorker *)calloc(batch.nWorkers, sizeof(*batch.workers));
+    for (int w = 0; w < batch.nWorkers; w++)
+        atomic_init(&batch.queues[w].range, RANGE((long)batch.nTasks * w / batch.nWorkers,
+                                                  (long)batch.nTasks * (w + 1) / batch.nWorkers));
+
+    double start = nowNs();
+    for (int w = 0; w < batch.nWorkers; w++)
+    {
+        batch.workers[w].index = w;
+        batch.workers[w].batch = &batch;
+        pthread_create(&batch.workers[w].thread, NULL, batchWorker, &batch.workers[w]);
+    }
+    for (int w = 0; w < batch.nWorkers; w++)
+    {
+        pthread_join(batch.workers[w].thread, NULL);
+        files += batch.workers[w].files;
+        skipped += batch.workers[w].skipped;
+        inputFrames += batch.workers[w].inputFrames;
+        outputFrames += batch.workers[w].outputFrames;
+        steals += batch.workers[w].steals;
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    fprintf(stdout, "Rendered %ld files on %d workers (%ld stolen) in %.3f s\n", files, batch.nWorkers, steals, seconds);
+    if (skipped > 0)
+        fprintf(stdout, "Skipped %ld files that could not be read\n", skipped);
+    fprintf(stdout, "%.1f files/s, %.1f Mframes/s in, %.1f Mframes/s out, %.1f MB/s written\n", files / seconds,
+            inputFrames / seconds / 1e6, outputFrames / seconds / 1e6, outputFrames * 4 / seconds / 1e6);
+
+    for (int i = 0; i < batch.nTasks; i++)
+        free(batch.tasks[i].filename);
+    free(batch.tasks);
+    free(batch.queues);
+    free(batch.workers);
+    return skipped > 0;
+}
+
+int main(int argc, char **argv)
+{
+    // output options come before the mode
+    while (argc >= 2 && (strcmp(argv[1], "--dither") == 0 || strcmp(argv[1], "--true-stereo") == 0 ||
+                         ((strcmp(argv[1], "--format") == 0 || strcmp(argv[1], "--tail-db") == 0 ||
+                           strcmp(argv[1], "--decimate") == 0 || strcmp(argv[1], "--quality") == 0 ||
+                           strcmp(argv[1], "--checkpoint") == 0) &&
+                          argc >= 3)))
+    {
+        if (strcmp(argv[1], "--dither") == 0 || strcmp(argv[1], "--true-stereo") == 0)
+        {
+            if (strcmp(argv[1], "--dither") == 0)
+                outputDither = 1;
+            else
+                trueStereo = 1;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+            continue;
+        }
+        if (strcmp(argv[1], "--tail-db") == 0)
+            tailLevelDb = fabs(atof(argv[2]));
+        else if (strcmp(argv[1], "--checkpoint") == 0)
+            checkpointSeconds = fabs(atof(argv[2]));
+        else if (strcmp(argv[1], "--quality") == 0)
+        {
+            for (reverbQuality = 0; reverbQuality < REVERB_QUALITY_MAX; reverbQuality++)
+                if (strcmp(argv[2], qualityNames[reverbQuality]) == 0)
+                    break;
+            if (reverbQuality == REVERB_QUALITY_MAX)
+            {
+                fprintf(stderr, "Unknown quality %s. Use full, no-mod, reduced-taps or half-rate.\n", argv[2]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[1], "--decimate") == 0)
+        {
+            tankDecimation = atoi(argv[2]);
+            if (tankDecimation != 1 && tankDecimation != 2 && tankDecimation != 4)
+            {
+                fprintf(stderr, "Unknown decimation %s. Use 1, 2 or 4.\n", argv[2]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[2], "s16") == 0 || strcmp(argv[2], "s24") == 0 || strcmp(argv[2], "f32") == 0)
+        {
+            outputBits = atoi(argv[2] + 1);
+            outputFloat = argv[2][0] == 'f';
+        }
+        else
+        {
+            fprintf(stderr, "Unknown format %s. Use s16, s24 or f32.\n", argv[2]);
+            return 1;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    // check for input file
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s [--format s16|s24|f32] [--dither] [--tail-db dB] [--decimate 1|2|4] [--quality tier] [--true-stereo] [--checkpoint seconds] <input.wav>\n", argv[0]);
+        fprintf(stderr, "       %s --memory\n", argv[0]);
+        fprintf(stderr, "       %s --latency [block_frames ...]\n", argv[0]);
+        fprintf(stderr, "       %s --convolve <input.wav> [threads]\n", argv[0]);
+        fprintf(stderr, "       %s --parallel <input.wav> [threads]\n", argv[0]);
+        fprintf(stderr, "       %s --mmap <input.wav>\n", argv[0]);
+        fprintf(stderr, "       %s [--format s16|s24|f32] [--dither] --surround stereo|5.1|7.1|foa <input.wav>\n", argv[0]);
+        fprintf(stderr, "       %s [--format s16|s24|f32] [--dither] --pipeline <input.wav>\n", argv[0]);
+        fprintf(stderr, "       %s --uring <input.wav> ...\n", argv[0]);
+        fprintf(stderr, "       %s --io-bench <input.wav> ...\n", argv[0]);
+        fprintf(stderr, "       %s [--format s16|s24|f32] [--dither] --batch [-j threads] [--preset name] <input.wav|dir> ...\n", argv[0]);
+        fprintf(stderr, "       %s [--format s16|s24|f32] [--dither] --multi [-j threads] [--mono] <input.wav>\n", argv[0]);
+        fprintf(stderr, "       %s [--format s16|s24|f32] [--dither] --raw [-f s16|s24|f32] [-r rate] [-c channels] [-b block_frames] < in.raw > out.raw\n", argv[0]);
+        fprintf(stderr, "       %s --output-bench\n", argv[0]);
+        fprintf(stderr, "       %s --quality-bench\n", argv[0]);
+        fprintf(stderr, "       %s --bus-bench [sources]\n", argv[0]);
+        fprintf(stderr, "       %s --freeze-bench\n", argv[0]);
+        fprintf(stderr, "       %s --pool-bench [threads]\n", argv[0]);
+        fprintf(stderr, "       %s --tlb-bench [instances]\n", argv[0]);
+        fprintf(stderr, "       %s --crossfade-check\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "--batch") == 0)
+        return renderBatch(argc - 2, argv + 2);
+    if (strcmp(argv[1], "--multi") == 0)
+        return renderMultichannel(argc - 2, argv + 2);
+    if (strcmp(argv[1], "--raw") == 0)
+    {
+        // a closed pipe is reported by write, rather than killing us
+        signal(SIGPIPE, SIG_IGN);
+        return renderRaw(argc - 2, argv + 2);
+    }
+    if (strcmp(argv[1], "--uring") == 0 && argc >= 3)
+    {
+        renderFilesAsync(argc - 2, argv + 2, ASYNC_IO_URING, 1);
+        return 0;
+    }
+    if (strcmp(argv[1], "--io-bench") == 0 && argc >= 3)
+        return ioBenchmark(argc - 2, argv + 2);
+    if (strcmp(argv[1], "--pipeline") == 0 && argc >= 3)
+        return renderPipelinedFile(argv[2]);
+    if (strcmp(argv[1], "--mmap") == 0 && argc >= 3)
+        return renderMappedFile(argv[2]);
+    if (strcmp(argv[1], "--surround") == 0 && argc >= 4)
+        return renderSurround(argv[2], argv[3]);
+    if (strcmp(argv[1], "--parallel") == 0 && argc >= 3)
+        return parallelFile(argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+    if (strcmp(argv[1], "--convolve") == 0 && argc >= 3)
+        return convolveFile(argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+    if (strcmp(argv[1], "--memory") == 0)
+        return memoryReport();
+    if (strcmp(argv[1], "--output-bench") == 0)
+        return outputBenchmark();
+    if (strcmp(argv[1], "--quality-bench") == 0)
+        return qualityBenchmark();
+    if (strcmp(argv[1], "--bus-bench") == 0)
+        return busBenchmark(argc >= 3 ? atoi(argv[2]) : 16);
+    if (strcmp(argv[1], "--freeze-bench") == 0)
+        return freezeBenchmark();
+    if (strcmp(argv[1], "--pool-bench") == 0)
+        return poolBenchmark(argc >= 3 ? atoi(argv[2]) : 4);
+    if (strcmp(argv[1], "--tlb-bench") == 0)
+        return tlbBenchmark(argc >= 3 && atoi(argv[2]) > 0 ? atoi(argv[2]) : 128);
+    if (strcmp(argv[1], "--crossfade-check") == 0)
+        return crossfadeCheck();
+    if (strcmp(argv[1], "--latency") == 0)
+    {
+        const int defaultBlockSizes[] = {16, 32, 64, 128};
+        int blockSizes[64];
+        int nBlockSizes = 0;
+        for (int i = 2; i < argc && nBlockSizes < 64; i++)
+            if ((blockSizes[nBlockSizes] = atoi(argv[i])) > 0)
+                nBlockSizes++;
+        if (nBlockSizes == 0)
+            return latencyBenchmark(4, defaultBlockSizes);
+        return latencyBenchmark(nBlockSizes, blockSizes);
+    }
+    renderFile(argv[1], 1);
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,745 @@
+/**
+    @file wav_io.c
+    @brief WAV file reading and writing for the reverb test tool.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+#include "wav_io.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+/* Fill in the format of interleaved output at the given depth, 16 or 24 bit
+   PCM or 32 bit float, with a WAV_HEADER_BYTES header */
+void wavPcmFormat(WavFormat *format, int sampleRate, int channels, int bitsPerSample, int isFloat)
+{
+    format->sampleRate = sampleRate;
+    format->channels = channels;
+    format->bitsPerSample = isFloat ? 32 : bitsPerSample;
+    format->isFloat = isFloat;
+    format->blockAlign = channels * format->bitsPerSample / 8;
+    format->dataOffset = WAV_HEADER_BYTES;
+    format->frames = 0;
+}
+
+void wavStereoFormat(WavFormat *format, int sampleRate, int bitsPerSample, int isFloat)
+{
+    wavPcmFormat(format, sampleRate, 2, bitsPerSample, isFloat);
+}
+
+/* Format a header for dataSize bytes of samples into WAV_HEADER_BYTES bytes of memory */
+void wavFormatHeader(unsigned char *header, uint32_t dataSize, const WavFormat *format)
+{
+    /* RIFF header fields */
+    uint32_t fileSize = 36 + dataSize; /* 36 + subchunk2Size */
+    uint32_t subchunkSize = 16;        /* PCM */
+    uint16_t channels = format->channels;
+    uint16_t bitsPerSample = format->bitsPerSample;
+    uint16_t audioFormat = format->isFloat ? 3 : 1; /* IEEE float or PCM */
+    uint32_t sampleRate_ = format->sampleRate;
+    uint32_t byteRate = format->sampleRate * channels * (bitsPerSample / 8);
+    uint16_t blockAlign = channels * (bitsPerSample / 8);
+
+    /* the RIFF chunk descriptor */
+    memcpy(header, "RIFF", 4);
+    memcpy(header + 4, &fileSize, 4);
+    memcpy(header + 8, "WAVE", 4);
+
+    /* the 'fmt ' sub-chunk */
+    memcpy(header + 12, "fmt ", 4);
+    memcpy(header + 16, &subchunkSize, 4);
+    memcpy(header + 20, &audioFormat, 2);
+    memcpy(header + 22, &channels, 2);
+    memcpy(header + 24, &sampleRate_, 4);
+    memcpy(header + 28, &byteRate, 4);
+    memcpy(header + 32, &blockAlign, 2);
+    memcpy(header + 34, &bitsPerSample, 2);
+
+    /* the 'data' sub-chunk */
+    memcpy(header + 36, "data", 4);
+    memcpy(header + 40, &dataSize, 4);
+}
+
+/* Whether frames of the format fit in a WAV file, whose RIFF size is 32 bits */
+int wavFitsFrames(const WavFormat *format, long frames)
+{
+    return frames >= 0 && (uint64_t)frames * format->blockAlign <= WAV_MAX_DATA_BYTES;
+}
+
+/* Write a header for dataSize bytes of samples; returns 0 on a write error */
+static int writeWavHeader(FILE *fp, uint32_t dataSize, const WavFormat *format)
+{
+    unsigned char header[WAV_HEADER_BYTES];
+    wavFormatHeader(header, dataSize, format);
+    return fwrite(header, 1, WAV_HEADER_BYTES, fp) == WAV_HEADER_BYTES;
+}
+
+/* Find the format and data chunks of a WAV file, skipping any others (LIST,
+   bext, ...). Returns 1 if it has up to WAV_MAX_CHANNELS channels of 16, 24 or
+   32 bit PCM or 32 bit float, plain or WAVE_FORMAT_EXTENSIBLE, and 0 otherwise */
+int wavReadFormat(int fd, WavFormat *format)
+{
+    unsigned char chunk[40];
+    struct stat st;
+    off_t offset = 12;
+    uint32_t chunkSize;
+    // all zero (and so rejected below) if there is no format chunk
+    uint16_t audioFormat = 0, numChannels = 0, blockAlign = 0, bitsPerSample = 0;
+    uint32_t sampleRate_ = 0;
+
+    if (fstat(fd, &st) != 0 || pread(fd, chunk, 12, 0) != 12 ||
+        memcmp(chunk, "RIFF", 4) != 0 || memcmp(chunk + 8, "WAVE", 4) != 0)
+        return 0;
+
+    for (;;)
+    {
+        if (pread(fd, chunk, 8, offset) != 8)
+            return 0;
+        memcpy(&chunkSize, chunk + 4, 4);
+        offset += 8;
+        if (memcmp(chunk, "data", 4) == 0)
+            break;
+        if (memcmp(chunk, "fmt ", 4) == 0)
+        {
+            size_t size = chunkSize < sizeof(chunk) ? chunkSize : sizeof(chunk);
+            if (chunkSize < 16 || pread(fd, chunk, size, offset) != (ssize_t)size)
+                return 0;
+            memcpy(&audioFormat, chunk, 2);
+            memcpy(&numChannels, chunk + 2, 2);
+            memcpy(&sampleRate_, chunk + 4, 4);
+            memcpy(&blockAlign, chunk + 12, 2);
+            memcpy(&bitsPerSample, chunk + 14, 2);
+            // WAVE_FORMAT_EXTENSIBLE: the real format is the start of the subformat GUID
+            if (audioFormat == 0xFFFE)
+            {
+                if (chunkSize < 40)
+                    return 0;
+                memcpy(&audioFormat, chunk + 24, 2);
+            }
+        }
+        // chunks are padded to an even length
+        offset += chunkSize + (chunkSize & 1);
+    }
+
+    if (numChannels < 1 || numChannels > WAV_MAX_CHANNELS ||
+        !((audioFormat == 1 && (bitsPerSample == 16 || bitsPerSample == 24 || bitsPerSample == 32)) ||
+          (audioFormat == 3 && bitsPerSample == 32)) ||
+        blockAlign != numChannels * bitsPerSample / 8)
+        return 0;
+
+    format->sampleRate = sampleRate_;
+    format->channels = numChannels;
+    format->bitsPerSample = bitsPerSample;
+    format->isFloat = audioFormat == 3;
+    format->blockAlign = blockAlign;
+    format->dataOffset = offset;
+    // a truncated (or still being written) file only has the samples that are actually there
+    if (offset + (off_t)chunkSize > st.st_size)
+        chunkSize = st.st_size > offset ? st.st_size - offset : 0;
+    format->frames = chunkSize / blockAlign;
+    return 1;
+}
+
+/* Report an unsupported file */
+static void wavFormatError(const char *filename)
+{
+    fprintf(stderr, "Unsupported WAV file %s. Must be 16, 24 or 32 bit PCM or 32 bit float audio.\n", filename);
+}
+
+/* Read the format of a file to be read as stereo, which must be mono or
+   stereo; returns 0 after reporting why if it cannot be */
+static int readStereoFormat(int fd, WavFormat *format, const char *filename)
+{
+    if (!wavReadFormat(fd, format))
+    {
+        wavFormatError(filename);
+        return 0;
+    }
+    if (format->channels > 2)
+    {
+        fprintf(stderr, "%s has %d channels; only mono or stereo can be read as stereo.\n", filename, format->channels);
+        return 0;
+    }
+    return 1;
+}
+
+/* The conversion kernels work on unaligned bytes, as chunks before the data
+   need not leave it aligned (or mapped files at any particular offset). Each
+   handles blocks of samples with SSE2 (or SSSE3 for 24 bit, when compiled with
+   -mssse3 or -march=native) and the remainder one at a time */
+static void convert16(const unsigned char *raw, float *samples, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(raw + i * 2));
+        // sign extend by moving each sample to the top half and shifting back down
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(samples + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        int16_t x;
+        memcpy(&x, raw + i * 2, 2);
+        samples[i] = x / 32768.0f;
+    }
+}
+
+static void convert24(const unsigned char *raw, float *samples, int n)
+{
+    int i = 0;
+#ifdef __SSSE3__
+    // place each 3 byte sample in the top of a 32 bit lane, then treat it as 32 bit
+    const __m128i spread = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    // each load reads 16 bytes but uses 12, so stop while a whole load still fits
+    for (; i + 6 <= n; i += 4)
+    {
+        __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(raw + i * 3)), spread);
+        _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        const unsigned char *p = raw + i * 3;
+        int32_t x = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+        samples[i] = x * (1.0f / 2147483648.0f);
+    }
+}
+
+static void convert32(const unsigned char *raw, float *samples, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(raw + i * 4));
+        _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        int32_t x;
+        memcpy(&x, raw + i * 4, 4);
+        samples[i] = x * (1.0f / 2147483648.0f);
+    }
+}
+
+/* Spread frames of mono in place into interleaved stereo, working backwards so
+   nothing is overwritten before it is read */
+static void monoToStereo(float *samples, int frames)
+{
+    int i = frames;
+    for (; i % 4; i--)
+        samples[(i - 1) * 2] = samples[(i - 1) * 2 + 1] = samples[i - 1];
+#ifdef __SSE2__
+    for (; i > 0; i -= 4)
+    {
+        __m128 x = _mm_loadu_ps(samples + i - 4);
+        _mm_storeu_ps(samples + (i - 4) * 2 + 4, _mm_unpackhi_ps(x, x));
+        _mm_storeu_ps(samples + (i - 4) * 2, _mm_unpacklo_ps(x, x));
+    }
+#endif
+    for (; i > 0; i--)
+        samples[(i - 1) * 2] = samples[(i - 1) * 2 + 1] = samples[i - 1];
+}
+
+/* Convert frames in the given format to interleaved float, keeping every channel */
+void wavToFloat(const WavFormat *format, const void *raw, float *samples, int frames)
+{
+    int n = frames * format->channels;
+
+    if (format->isFloat)
+        memcpy(samples, raw, n * sizeof(float));
+    else if (format->bitsPerSample == 16)
+        convert16((const unsigned char *)raw, samples, n);
+    else if (format->bitsPerSample == 24)
+        convert24((const unsigned char *)raw, samples, n);
+    else
+        convert32((const unsigned char *)raw, samples, n);
+}
+
+/* Convert frames of mono or stereo in the given format to interleaved stereo
+   float, duplicating mono */
+void wavToFloatStereo(const WavFormat *format, const void *raw, float *samples, int frames)
+{
+    wavToFloat(format, raw, samples, frames);
+    if (format->channels == 1)
+        monoToStereo(samples, frames);
+}
+
+/* Seed the dither generators. Any seed gives non-zero states */
+void wavDitherInit(WavDither *dither, uint32_t seed)
+{
+    for (int i = 0; i < 8; i++)
+        dither->state[i] = ((seed + i) * 2654435761u) | 1;
+}
+
+#ifdef __SSE2__
+/* Four samples of triangular (TPDF) noise in (-1, 1): the difference of the
+   two 16 bit halves of four xorshift32 generators */
+static inline __m128 tpdf4(__m128i *state)
+{
+    __m128i x = *state;
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+    *state = x;
+    __m128i d = _mm_sub_epi32(_mm_srli_epi32(x, 16), _mm_and_si128(x, _mm_set1_epi32(0xffff)));
+    return _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(1.0f / 65536.0f));
+}
+
+/* Scale, dither, saturate and convert four samples to integers of the given range */
+static inline __m128i quantize4(__m128 x, __m128 scale, __m128 lo, __m128 hi, WavDither *dither, __m128i *state)
+{
+    x = _mm_mul_ps(x, scale);
+    if (!dither)
+        return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(x, lo), hi));
+    // round, rather than truncate, once dithered
+    x = _mm_add_ps(x, tpdf4(state));
+    return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, lo), hi));
+}
+#endif
+
+/* The scalar equivalent of quantize4, using the first generator */
+static inline int32_t quantize(float x, float scale, float lo, float hi, WavDither *dither)
+{
+    x *= scale;
+    if (dither)
+    {
+        uint32_t r = dither->state[0];
+        r ^= r << 13;
+        r ^= r >> 17;
+        r ^= r << 5;
+        dither->state[0] = r;
+        x += ((int32_t)(r >> 16) - (int32_t)(r & 0xffff)) * (1.0f / 65536.0f);
+    }
+    // like the SSE min/max, NaN goes to the bottom of the range
+    x = x > lo ? x : lo;
+    x = x < hi ? x : hi;
+    return dither ? (int32_t)lrintf(x) : (int32_t)x;
+}
+
+/* Convert n samples to 16 bit, saturating, with optional dither (NULL for none).
+   Alternate blocks of four take their noise from the two sets of generators, so
+   the two chains of xorshifts run in parallel */
+static void quantize16(const float *samples, unsigned char *raw, int n, WavDither *dither)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(32768.0f), lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+    __m128i a = _mm_setzero_si128(), b = _mm_setzero_si128();
+    if (dither)
+    {
+        a = _mm_loadu_si128((const __m128i *)dither->state);
+        b = _mm_loadu_si128((const __m128i *)(dither->state + 4));
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i x0 = quantize4(_mm_loadu_ps(samples + i), scale, lo, hi, dither, &a);
+        __m128i x1 = quantize4(_mm_loadu_ps(samples + i + 4), scale, lo, hi, dither, &b);
+        _mm_storeu_si128((__m128i *)(raw + i * 2), _mm_packs_epi32(x0, x1));
+    }
+    if (dither)
+    {
+        _mm_storeu_si128((__m128i *)dither->state, a);
+        _mm_storeu_si128((__m128i *)(dither->state + 4), b);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        int16_t x = quantize(samples[i], 32768.0f, -32768.0f, 32767.0f, dither);
+        memcpy(raw + i * 2, &x, 2);
+    }
+}
+
+/* Convert n samples to packed 24 bit, saturating, with optional dither (NULL for none) */
+static void quantize24(const float *samples, unsigned char *raw, int n, WavDither *dither)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(8388608.0f), lo = _mm_set1_ps(-8388608.0f), hi = _mm_set1_ps(8388607.0f);
+    __m128i a = _mm_setzero_si128(), b = _mm_setzero_si128();
+    if (dither)
+    {
+        a = _mm_loadu_si128((const __m128i *)dither->state);
+        b = _mm_loadu_si128((const __m128i *)(dither->state + 4));
+    }
+#ifdef __SSSE3__
+    // drop the top byte of each lane; each store writes 16 bytes but advances 12,
+    // so stop while the last store still fits
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for (; i + 10 <= n; i += 8)
+    {
+        __m128i x0 = quantize4(_mm_loadu_ps(samples + i), scale, lo, hi, dither, &a);
+        __m128i x1 = quantize4(_mm_loadu_ps(samples + i + 4), scale, lo, hi, dither, &b);
+        _mm_storeu_si128((__m128i *)(raw + i * 3), _mm_shuffle_epi8(x0, pack));
+        _mm_storeu_si128((__m128i *)(raw + i * 3 + 12), _mm_shuffle_epi8(x1, pack));
+    }
+#else
+    for (; i + 8 <= n; i += 8)
+    {
+        _Alignas(16) int32_t x[8];
+        _mm_store_si128((__m128i *)x, quantize4(_mm_loadu_ps(samples + i), scale, lo, hi, dither, &a));
+        _mm_store_si128((__m128i *)(x + 4), quantize4(_mm_loadu_ps(samples + i + 4), scale, lo, hi, dither, &b));
+        for (int j = 0; j < 8; j++)
+        {
+            raw[(i + j) * 3] = x[j];
+            raw[(i + j) * 3 + 1] = x[j] >> 8;
+            raw[(i + j) * 3 + 2] = x[j] >> 16;
+        }
+    }
+#endif
+    if (dither)
+    {
+        _mm_storeu_si128((__m128i *)dither->state, a);
+        _mm_storeu_si128((__m128i *)(dither->state + 4), b);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        int32_t x = quantize(samples[i], 8388608.0f, -8388608.0f, 8388607.0f, dither);
+        raw[i * 3] = x;
+        raw[i * 3 + 1] = x >> 8;
+        raw[i * 3 + 2] = x >> 16;
+    }
+}
+
+/* Convert interleaved float frames to the given output format, with the same
+   number of channels. 16 and 24 bit saturate, and are TPDF dithered unless
+   dither is NULL; float is copied */
+void wavFromFloat(const WavFormat *format, const float *samples, void *raw, int frames, WavDither *dither)
+{
+    int n = frames * format->channels;
+
+    if (format->isFloat)
+        memcpy(raw, samples, n * sizeof(float));
+    else if (format->bitsPerSample == 24)
+        quantize24(samples, (unsigned char *)raw, n, dither);
+    else
+        quantize16(samples, (unsigned char *)raw, n, dither);
+}
+
+/* Convert to 16 bit, truncating and saturating, without dither */
+void wavFloatToShort(const float *samples, int16_t *shortSamples, int n)
+{
+    quantize16(samples, (unsigned char *)shortSamples, n, NULL);
+}
+
+void wavShortToFloat(const int16_t *shortSamples, float *samples, int n)
+{
+    convert16((const unsigned char *)shortSamples, samples, n);
+}
+
+void writeWavStereo16(const char *filename,
+                      const float *samples,
+                      int numSamples,
+                      int sampleRate)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot open %s for writing.\n", filename);
+        exit(1);
+    }
+    WavFormat format;
+    wavStereoFormat(&format, sampleRate, 16, 0);
+    if (!wavFitsFrames(&format, numSamples))
+    {
+        fprintf(stderr, "%s would be too long for a WAV file.\n", filename);
+        exit(1);
+    }
+    int ok = writeWavHeader(fp, numSamples * sizeof(int16_t) * 2, &format);
+
+    /* Write the samples */
+    int16_t *shortSamples = (int16_t *)malloc(numSamples * 2 * sizeof(int16_t));
+    wavFloatToShort(samples, shortSamples, numSamples * 2);
+    ok = ok && fwrite(shortSamples, sizeof(int16_t), numSamples * 2, fp) == (size_t)numSamples * 2;
+    free(shortSamples);
+
+    if (fclose(fp) != 0 || !ok)
+    {
+        fprintf(stderr, "Cannot write %s.\n", filename);
+        exit(1);
+    }
+}
+
+/* Read a whole WAV file in any supported format as interleaved stereo float */
+void readWavStereo(const char *filename,
+                   float **samples,
+                   int *numSamples,
+                   int *sampleRate)
+{
+    WavFormat format;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot open %s for reading.\n", filename);
+        exit(1);
+    }
+    if (!readStereoFormat(fileno(fp), &format, filename))
+        exit(1);
+
+    *sampleRate = format.sampleRate;
+    unsigned char *raw = (unsigned char *)malloc(format.frames * format.blockAlign);
+    fseek(fp, format.dataOffset, SEEK_SET);
+    *numSamples = fread(raw, format.blockAlign, format.frames, fp);
+    *samples = (float *)malloc(*numSamples * 2 * sizeof(float));
+    wavToFloatStereo(&format, raw, *samples, *numSamples);
+    free(raw);
+
+    fclose(fp);
+}
+
+/* Open a mono or stereo WAV file in any supported format to be read in
+   chunks as stereo. Returns 1, or 0 after reporting why if it cannot be read */
+int wavOpenRead(WavReader *reader, const char *filename)
+{
+    reader->fp = fopen(filename, "rb");
+    if (!reader->fp)
+    {
+        fprintf(stderr, "Cannot open %s for reading.\n", filename);
+        return 0;
+    }
+    if (!readStereoFormat(fileno(reader->fp), &reader->format, filename))
+    {
+        fclose(reader->fp);
+        return 0;
+    }
+    fseek(reader->fp, reader->format.dataOffset, SEEK_SET);
+    reader->sampleRate = reader->format.sampleRate;
+    reader->framesLeft = reader->format.frames;
+    reader->scratch = NULL;
+    reader->scratchFrames = 0;
+    return 1;
+}
+
+/* Read up to maxFrames frames as interleaved stereo; returns the number read, 0 at the end */
+int wavReadFrames(WavReader *reader, float *samples, int maxFrames)
+{
+    int frames = maxFrames < reader->framesLeft ? maxFrames : (int)reader->framesLeft;
+    if (frames > reader->scratchFrames)
+    {
+        reader->scratch = (unsigned char *)realloc(reader->scratch, frames * reader->format.blockAlign);
+        reader->scratchFrames = frames;
+    }
+    frames = fread(reader->scratch, reader->format.blockAlign, frames, reader->fp);
+    wavToFloatStereo(&reader->format, reader->scratch, samples, frames);
+    reader->framesLeft -= frames;
+    if (frames < maxFrames)
+        reader->framesLeft = 0;
+    return frames;
+}
+
+/* Skip the next frames of the file without reading them */
+void wavSkipFrames(WavReader *reader, long frames)
+{
+    frames = frames < reader->framesLeft ? frames : reader->framesLeft;
+    fseek(reader->fp, frames * reader->format.blockAlign, SEEK_CUR);
+    reader->framesLeft -= frames;
+}
+
+void wavCloseRead(WavReader *reader)
+{
+    fclose(reader->fp);
+    free(reader->scratch);
+}
+
+/* Create a WAV file in the given format (from wavStereoFormat) to be written
+   in chunks, optionally dithered; the header is completed on close */
+void wavOpenWrite(WavWriter *writer, const char *filename, const WavFormat *format, int dither)
+{
+    writer->fp = fopen(filename, "wb");
+    if (!writer->fp)
+    {
+        fprintf(stderr, "Cannot open %s for writing.\n", filename);
+        exit(1);
+    }
+    writer->format = *format;
+    writer->sampleRate = format->sampleRate;
+    writer->frames = 0;
+    writer->dithered = dither;
+    wavDitherInit(&writer->dither, 1);
+    writer->scratch = NULL;
+    writer->scratchFrames = 0;
+    if (!writeWavHeader(writer->fp, 0, format))
+    {
+        fprintf(stderr, "Cannot write %s.\n", filename);
+        exit(1);
+    }
+}
+
+/* Reopen a file left by wavOpenWrite in the same format, to carry on writing
+   after its first frames; anything after them is overwritten. The dither
+   state starts afresh, and can be restored into writer->dither */
+void wavOpenAppend(WavWriter *writer, const char *filename, const WavFormat *format, int dither, long frames)
+{
+    writer->fp = fopen(filename, "r+b");
+    if (!writer->fp || fseek(writer->fp, 0, SEEK_END) != 0 ||
+        ftell(writer->fp) < format->dataOffset + frames * format->blockAlign)
+    {
+        fprintf(stderr, "Cannot append to %s after %ld frames.\n", filename, frames);
+        exit(1);
+    }
+    writer->format = *format;
+    writer->sampleRate = format->sampleRate;
+    writer->frames = frames;
+    writer->dithered = dither;
+    wavDitherInit(&writer->dither, 1);
+    writer->scratch = NULL;
+    writer->scratchFrames = 0;
+    fseek(writer->fp, format->dataOffset + frames * format->blockAlign, SEEK_SET);
+}
+
+/* Append interleaved stereo frames. Stops the program, before the header's
+   sizes would wrap, if the file would grow past what a WAV file can hold */
+void wavWriteFrames(WavWriter *writer, const float *samples, int frames)
+{
+    if (!wavFitsFrames(&writer->format, writer->frames + frames))
+    {
+        fprintf(stderr, "Output is too long for a WAV file (%.0f bytes of samples at most).\n",
+                (double)WAV_MAX_DATA_BYTES);
+        exit(1);
+    }
+    if (frames > writer->scratchFrames)
+    {
+        writer->scratch = (unsigned char *)realloc(writer->scratch, frames * writer->format.blockAlign);
+        writer->scratchFrames = frames;
+    }
+    wavFromFloat(&writer->format, samples, writer->scratch, frames, writer->dithered ? &writer->dither : NULL);
+    if (fwrite(writer->scratch, writer->format.blockAlign, frames, writer->fp) != (size_t)frames)
+    {
+        fprintf(stderr, "Cannot write the output: %s\n", strerror(errno));
+        exit(1);
+    }
+    writer->frames += frames;
+}
+
+/* Patch the RIFF sizes now the length is known, and close the file.
+   wavWriteFrames has kept them within 32 bits */
+void wavCloseWrite(WavWriter *writer)
+{
+    uint32_t dataSize = writer->frames * writer->format.blockAlign;
+    uint32_t fileSize = 36 + dataSize;
+    int ok = fseek(writer->fp, 4, SEEK_SET) == 0 && fwrite(&fileSize, 4, 1, writer->fp) == 1 &&
+             fseek(writer->fp, WAV_HEADER_BYTES - 4, SEEK_SET) == 0 && fwrite(&dataSize, 4, 1, writer->fp) == 1;
+
+    // a full disk may only show when the buffered samples are flushed
+    if (fclose(writer->fp) != 0 || !ok)
+    {
+        fprintf(stderr, "Cannot finish writing the output: %s\n", strerror(errno));
+        exit(1);
+    }
+    free(writer->scratch);
+}
+
+/* Map a WAV file in any supported format for reading; the samples are
+   converted straight from the mapping, with wavMapGetFrames for mono or
+   stereo, or wavToFloat on map->data for any number of channels */
+void wavMapRead(WavMap *map, const char *filename)
+{
+    struct stat st;
+
+    map->fd = open(filename, O_RDONLY);
+    if (map->fd < 0 || fstat(map->fd, &st) != 0)
+    {
+        fprintf(stderr, "Cannot open %s for reading.\n", filename);
+        exit(1);
+    }
+    if (!wavReadFormat(map->fd, &map->format))
+    {
+        wavFormatError(filename);
+        exit(1);
+    }
+    map->size = st.st_size;
+    map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, map->fd, 0);
+    if (map->base == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map %s.\n", filename);
+        exit(1);
+    }
+    madvise(map->base, map->size, MADV_SEQUENTIAL);
+
+    map->sampleRate = map->format.sampleRate;
+    map->frames = map->format.frames;
+    map->data = (unsigned char *)map->base + map->format.dataOffset;
+}
+
+/* Create a WAV file of the given length and format (from wavPcmFormat),
+   pre-sized and mapped for writing in place */
+void wavMapWrite(WavMap *map, const char *filename, const WavFormat *format, long frames)
+{
+    if (!wavFitsFrames(format, frames))
+    {
+        fprintf(stderr, "%s would be too long for a WAV file.\n", filename);
+        exit(1);
+    }
+    map->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    map->size = WAV_HEADER_BYTES + frames * format->blockAlign;
+    if (map->fd < 0 || ftruncate(map->fd, map->size) != 0)
+    {
+        fprintf(stderr, "Cannot open %s for writing.\n", filename);
+        exit(1);
+    }
+    // write the header through a stream, then map the file for the samples
+    map->format = *format;
+    map->format.frames = frames;
+    FILE *fp = fdopen(dup(map->fd), "wb");
+    if (!fp || !writeWavHeader(fp, frames * format->blockAlign, &map->format) || fclose(fp) != 0)
+    {
+        fprintf(stderr, "Cannot write %s.\n", filename);
+        exit(1);
+    }
+
+    map->base = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+    if (map->base == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map %s.\n", filename);
+        exit(1);
+    }
+    madvise(map->base, map->size, MADV_SEQUENTIAL);
+
+    map->sampleRate = format->sampleRate;
+    map->frames = frames;
+    map->data = (unsigned char *)map->base + WAV_HEADER_BYTES;
+}
+
+/* Convert frames from a mono or stereo mapping to interleaved stereo float */
+void wavMapGetFrames(const WavMap *map, long offset, float *samples, int frames)
+{
+    wavToFloatStereo(&map->format, map->data + offset * map->format.blockAlign, samples, frames);
+}
+
+/* Convert interleaved float frames, with the mapping's channels, into a
+   mapping created by wavMapWrite, without dither */
+void wavMapPutFrames(WavMap *map, long offset, const float *samples, int frames)
+{
+    wavFromFloat(&map->format, samples, map->data + offset * map->format.blockAlign, frames, NULL);
+}
+
+void wavUnmap(WavMap *map)
+{
+    munmap(map->base, map->size);
+    close(map->fd);
+}
@@ -0,0 +1,115 @@
+/**
+    @file wav_io.h
+    @brief WAV file reading and writing for the reverb test tool, either whole
+    files at once, streamed in chunks with constant memory use, or memory mapped.
+    Reads 16, 24 or 32 bit PCM or 32 bit float (including
+    WAVE_FORMAT_EXTENSIBLE), mono or stereo as interleaved stereo float, or
+    any number of channels through a mapping; writes 16 or 24 bit PCM,
+    optionally dithered, or 32 bit float.
+
+    @author John Williamson
+
+    Copyright (c) 2011-2025 All rights reserved.
+    Licensed under the MIT License, 2025.
+
+*/
+
+#ifndef __WAV_IO_H__
+#define __WAV_IO_H__
+#include <stdio.h>
+#include <stdint.h>
+
+#define WAV_HEADER_BYTES 44
+/* the most sample bytes the 32 bit RIFF size can describe */
+#define WAV_MAX_DATA_BYTES (UINT32_MAX - 36)
+#define WAV_MAX_CHANNELS 64
+
+/** @struct WavFormat The layout of the samples in a WAV file's data chunk */
+typedef struct WavFormat
+{
+    int sampleRate;
+    int channels;
+    int bitsPerSample;
+    int isFloat;
+    int blockAlign;
+    long dataOffset;
+    long frames;
+} WavFormat;
+
+/** @struct WavReader A WAV file being read in chunks */
+typedef struct WavReader
+{
+    FILE *fp;
+    WavFormat format;
+    int sampleRate;
+    long framesLeft;
+    unsigned char *scratch;
+    int scratchFrames;
+} WavReader;
+
+/** @struct WavDither TPDF dither state: two sets of four xorshift32
+    generators, one per SIMD lane */
+typedef struct WavDither
+{
+    uint32_t state[8];
+} WavDither;
+
+/** @struct WavWriter A stereo WAV file being written in chunks.
+    The RIFF sizes are patched in when it is closed. */
+typedef struct WavWriter
+{
+    FILE *fp;
+    WavFormat format;
+    int sampleRate;
+    long frames;
+    int dithered;
+    WavDither dither;
+    unsigned char *scratch;
+    int scratchFrames;
+} WavWriter;
+
+/** @struct WavMap A WAV file mapped into memory, with the samples accessed
+    in place */
+typedef struct WavMap
+{
+    int fd;
+    void *base;
+    size_t size;
+    WavFormat format;
+    int sampleRate;
+    long frames;
+    unsigned char *data;
+} WavMap;
+
+void wavPcmFormat(WavFormat *format, int sampleRate, int channels, int bitsPerSample, int isFloat);
+void wavStereoFormat(WavFormat *format, int sampleRate, int bitsPerSample, int isFloat);
+void wavFormatHeader(unsigned char *header, uint32_t dataSize, const WavFormat *format);
+int wavFitsFrames(const WavFormat *format, long frames);
+int wavReadFormat(int fd, WavFormat *format);
+void wavToFloat(const WavFormat *format, const void *raw, float *samples, int frames);
+void wavToFloatStereo(const WavFormat *format, const void *raw, float *samples, int frames);
+void wavDitherInit(WavDither *dither, uint32_t seed);
+void wavFromFloat(const WavFormat *format, const float *samples, void *raw, int frames, WavDither *dither);
+void wavFloatToShort(const float *samples, int16_t *shortSamples, int n);
+void wavShortToFloat(const int16_t *shortSamples, float *samples, int n);
+
+void writeWavStereo16(const char *filename, const float *samples, int numSamples, int sampleRate);
+void readWavStereo(const char *filename, float **samples, int *numSamples, int *sampleRate);
+
+int wavOpenRead(WavReader *reader, const char *filename);
+int wavReadFrames(WavReader *reader, float *samples, int maxFrames);
+void wavSkipFrames(WavReader *reader, long frames);
+void wavCloseRead(WavReader *reader);
+
+void wavOpenWrite(WavWriter *writer, const char *filename, const WavFormat *format, int dither);
+void wavOpenAppend(WavWriter *writer, const char *filename, const WavFormat *format, int dither, long frames);
+void wavWriteFrames(WavWriter *writer, const float *samples, int frames);
+void wavCloseWrite(WavWriter *writer);
+
+void wavMapRead(WavMap *map, const char *filename);
+void wavMapWrite(WavMap *map, const char *filename, const WavFormat *format, long frames);
+void wavMapGetFrames(const WavMap *map, long offset, float *samples, int frames);
+void wavMapPutFrames(WavMap *map, long offset, const float *samples, int frames);
+void wavUnmap(WavMap *map);
+
+#endif